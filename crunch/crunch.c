@@ -177,9 +177,7 @@
  *         add date support?
  *         specify multiple charset names using -f i.e. -f charset.lst + ualpha 123 +
  *         make permute use -e
- *         revamp compression part of renamefile 7z doesn't delete original file
  *         size calculations are wrong when min or max is larger than 12
- *         write word to temp file for resuming after power outage
  *
  *  usage: ./crunch <min-len> <max-len> [charset]
  *  e.g: ./crunch 3 7 abcdef
@@ -210,6 +208,9 @@
  *                name of the character set in the above file eg:
  *                mixalpha-numeric-all-space
  *  -i          : inverts the output so the first character will change very often
+ *  -j          : number of threads generating words, eg: 8  The output is the
+ *                same as with one thread.  With -c or -b each thread makes
+ *                whole files of its own.
  *  -l          : literal characters to use in -t @,%^
  *  -o          : allows you to specify the file to write the output to, eg:
  *                wordlist.txt
@@ -218,7 +219,8 @@
  *  -q          : Like the -p option except it reads the strings from the specified
  *                file.  It CANNOT be used with -s.  It also ignores min and max.
  *  -r          : resume a previous session.  You must use the same command line as
- *                the previous session.
+ *                the previous session.  Uses START.ckpt, written on ctrl-c,
+ *                or the ends of START, so START is not read through
  *  -s          : allows you to specify the starting string, eg: 03god22fs
  *  -t [FIXED]@,%^  : allows you to specify a pattern, eg: @@god@@@@
  *                where the only the @'s will change with lowercase letters
@@ -227,7 +229,46 @@
  *                the ^'s will change with symbols
  *  -u          : The -u option disables the printpercentage thread.  This should be the last option.
  *  -z          : adds support to compress the generated output.  Must be used
- *                with -o option.  Only supports gzip, bzip, lzma, and 7z.
+ *                with -o option.  Only supports gzip, bzip, lzma, xz, zstd,
+ *                lz4 and 7z.  Compressed as it is written when crunch is built
+ *                with the library, else the program is run on the file.
+ *  --checkpoint: seconds between updates of START.ckpt, which -r uses to
+ *                carry on after a crash or power cut, eg: 60
+ *  --count     : number of words to write, counting from --offset.
+ *  --offset    : skip this many words of the output without generating them,
+ *                eg: crunch 1 6 --offset 1000000 --count 500
+ *  --buffer    : size of the output buffer, 4mib by default.  Takes the same
+ *                units as -b up to mib, eg: crunch 1 8 --buffer 16mib
+ *  --flush     : longest time in milliseconds output may wait in the buffer,
+ *                for programs reading crunch through a pipe that want the
+ *                words as they come.  100 on a terminal, otherwise off
+ *  --direct    : write the -o file with O_DIRECT, keeping it out of the
+ *                page cache
+ *  --manifest  : file to add a line to for every file -o writes: its name,
+ *                bytes, words, CRC-32, number of its first word, first and
+ *                last word, tab separated
+ *  --mmap      : write the -o file through mmap, allocating its space before
+ *                starting so a full disk stops crunch right away
+ *  --pwrite    : with -j, workers write their words straight into the -o
+ *                file at offsets worked out in advance.  Needs every word
+ *                of a length to have the same number of bytes
+ *  --uring     : write the -o file with io_uring, so the next block of words
+ *                is made while the last one is being written
+ *  --vmsplice  : when stdout is a pipe, enlarge it and map the output
+ *                pages into it instead of copying them.  Only for readers
+ *                that read(2) the pipe, not ones that splice it onward
+ *  --zjobs     : number of threads compressing -z output, each buffer
+ *                becoming a block of its own, eg: -z gzip --zjobs 4
+ *                Not for -z lzma, use xz.  With 7z, or without the library,
+ *                the number of programs compressing finished files in the
+ *                background, 1 by default
+ *  --zindex    : with -z, write a table of the blocks next to each file, so
+ *                a range of words can be decompressed without the rest.
+ *                .zst files also get the zstd seekable format's seek table
+ *  --shard i/N : only write the i-th of N equal slices of the output,
+ *                counting from 1.  Applies after --offset and --count.
+ *                Writing all N shards one after the other gives the same
+ *                output as a single run, eg: crunch 1 8 --shard 3/16
  *
  *  This code can be easily adapted for use in brute-force attacks
  *  against network services or cryptography.
@@ -247,12 +288,30 @@ int crunch(){
   size_t flag3 = 0;  /* 0 display file size info 1 supress file size info */
   size_t flag4 = 0;  /* 0 don't create thread 1 create print % done thread */
   size_t resume = 0; /* 0 new session 1 for resume */
+  size_t seek = 0;   /* 0 whole keyspace 1 --offset, --count or --shard given */
+  size_t jobs = 1;   /* worker threads, -j */
+  size_t zjobs = 0;  /* compression threads, --zjobs.  0 compresses as it goes */
+  size_t outsize = OUT_BYTES; /* output buffer, --buffer */
+  long flush_ms = -1; /* --flush.  -1 for the default */
+  int vmsplice_out = 0; /* bool. --vmsplice */
+  int mmap_out = 0; /* bool. --mmap */
+  int uring_out = 0; /* bool. --uring */
+  int direct_out = 0; /* bool. --direct */
+  int pwrite_out = 0; /* bool. --pwrite */
+  int split_out = 0; /* bool. -j making whole -c or -b files */
+  int zindex = 0;    /* bool. --zindex */
   size_t arglen = 0; /* used in -b option to hold strlen */
   size_t min, max;   /* minimum and maximum size */
   size_t temp;       /* temp varible */
   size_t templen;    /* another temp var */
 
   unsigned long calc = 0;  /* recommend count */
+  unsigned long long seek_offset = 0; /* words to skip, --offset */
+  unsigned long long seek_count = 0;  /* words to write, --count.  0 for all */
+  unsigned long long seek_total;      /* words from -s to -e */
+  unsigned long long shard_index = 0; /* which slice to write, --shard i/N */
+  unsigned long long shard_count = 0; /* number of slices.  0 for no --shard */
+  unsigned long long temp_ull;        /* words left over after --shard */
   size_t dupvalue; /* value for duplicates option */
 
   int i = 3;      /* minimum number of parameters */
@@ -273,6 +332,7 @@ int crunch(){
   wchar_t *endstring = NULL;      /* hold -e option */
   char *charsetfilename = NULL;
   char *tempfilename = NULL;
+  char *ckpt = NULL;           /* START.ckpt */
   char *bcountval = NULL;
   wchar_t *literalstring = NULL; /* user passed something using -l */
   char *hold;
@@ -290,7 +350,7 @@ int crunch(){
 //  (void) signal(SIGINFO, printme);
 
   memset(&threads,0,sizeof(threads));
-  fptr = stdout;
+  out.fd = STDOUT_FILENO;
 
   if (setlocale(LC_ALL, "")==NULL) {
     fprintf(stderr,"Error: setlocale() failed\n");
@@ -303,6 +363,8 @@ int crunch(){
   options.last_min = options.first_max = NULL;
   options.min_string = options.max_string = NULL;
   options.pattern_info = NULL;
+  options.plan = NULL;
+  memset(options.symtabs, 0, sizeof(options.symtabs));
 
   if ((argc == 2) && (strncmp(argv[1], "-v", 2) == 0)) {  /* print version information */
     fprintf(stderr,"crunch version %s\n", version);
@@ -447,6 +509,44 @@ int crunch(){
     options.duplicates[temp] = (size_t)-1;
 
   for (; i<argc; i+=2) { /* add 2 to skip the parameter value */
+    /* options without a value go on to the next argument right away, so
+       the -i check further down can't land on them a second time */
+    if (strcmp(argv[i], "--direct") == 0) { /* write -o files with O_DIRECT */
+      direct_out = 1;
+      i--; /* decrease by 1 since --direct has no parameter value */
+      continue;
+    }
+
+    if (strcmp(argv[i], "--zindex") == 0) { /* write a block table with -z */
+      zindex = 1;
+      i--; /* decrease by 1 since --zindex has no parameter value */
+      continue;
+    }
+
+    if (strcmp(argv[i], "--mmap") == 0) { /* write -o files through a mapping */
+      mmap_out = 1;
+      i--; /* decrease by 1 since --mmap has no parameter value */
+      continue;
+    }
+
+    if (strcmp(argv[i], "--pwrite") == 0) { /* -j workers write into the -o file */
+      pwrite_out = 1;
+      i--; /* decrease by 1 since --pwrite has no parameter value */
+      continue;
+    }
+
+    if (strcmp(argv[i], "--uring") == 0) { /* write -o files through io_uring */
+      uring_out = 1;
+      i--; /* decrease by 1 since --uring has no parameter value */
+      continue;
+    }
+
+    if (strcmp(argv[i], "--vmsplice") == 0) { /* map output pages into the pipe */
+      vmsplice_out = 1;
+      i--; /* decrease by 1 since --vmsplice has no parameter value */
+      continue;
+    }
+
     if (strncmp(argv[i], "-b", 2) == 0) { /* user wants to split files by size */
       if (i+1 < argc) {
         bcountval = argv[i+1];
@@ -639,6 +739,20 @@ int crunch(){
       i--; /* decrease by 1 since -i has no parameter value */
     }
 
+    if (strncmp(argv[i], "-j", 2) == 0) { /* number of worker threads */
+      if (i+1 < argc) {
+        jobs = (size_t)strtoul(argv[i+1], &endptr, 10);
+        if (endptr == argv[i+1] || *endptr != '\0' || jobs == 0) {
+          fprintf(stderr,"-j must be followed by a number greater than 0\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      else {
+        fprintf(stderr,"Please specify the number of threads\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
     if (strncmp(argv[i], "-l", 2) == 0) { /* user wants to list literal characters */
       if (i+1 < argc) {
         literalstring = alloc_wide_string(argv[i+1],&saw_unicode_input);
@@ -782,16 +896,147 @@ int crunch(){
       i--;
     }
 
+    if (strcmp(argv[i], "--manifest") == 0) { /* list the files made with -o */
+      if (i+1 < argc)
+        manifest = argv[i+1];
+      else {
+        fprintf(stderr,"Please specify the manifest file\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if (strcmp(argv[i], "--zjobs") == 0) { /* compress -z output in parallel blocks */
+      if (i+1 < argc) {
+        zjobs = (size_t)strtoul(argv[i+1], &endptr, 10);
+        if (endptr == argv[i+1] || *endptr != '\0' || zjobs == 0) {
+          fprintf(stderr,"--zjobs must be followed by a number greater than 0\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      else {
+        fprintf(stderr,"Please specify the number of compression threads\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
     if (strncmp(argv[i], "-z", 2) == 0) {  /* compression algorithm specified */
       if (i+1 < argc) {
         compressalgo = argv[i+1];
-        if ((compressalgo != NULL) && (strcmp(compressalgo, "gzip") != 0) && (strcmp(compressalgo, "bzip2") != 0) && (strcmp(compressalgo,"lzma") != 0) && (strcmp(compressalgo,"7z") != 0)) {
-          fprintf(stderr,"Only gzip, bzip2, lzma, and 7z are supported\n");
+        if ((compressalgo != NULL) && (strcmp(compressalgo, "gzip") != 0) && (strcmp(compressalgo, "bzip2") != 0) && (strcmp(compressalgo,"lzma") != 0) && (strcmp(compressalgo,"xz") != 0) && (strcmp(compressalgo,"7z") != 0)
+#ifdef HAVE_ZSTD
+            && (strcmp(compressalgo,"zstd") != 0)
+#endif
+#ifdef HAVE_LZ4
+            && (strcmp(compressalgo,"lz4") != 0)
+#endif
+           ) {
+          fprintf(stderr,"Only gzip, bzip2, lzma, xz, 7z, and if crunch was built with them zstd and lz4 are supported\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      else {
+        fprintf(stderr,"Only gzip, bzip2, lzma, xz, 7z, and if crunch was built with them zstd and lz4 are supported\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if (strcmp(argv[i], "--count") == 0) { /* number of words to write */
+      if (i+1 < argc) {
+        seek_count = strtoull(argv[i+1], &endptr, 10);
+        if (!isdigit((unsigned char)argv[i+1][0]) || *endptr != '\0' || seek_count == 0) { /* strtoull takes -1 */
+          fprintf(stderr,"--count must be followed by a number greater than 0\n");
+          exit(EXIT_FAILURE);
+        }
+        seek = 1;
+      }
+      else {
+        fprintf(stderr,"Please specify the number of words you want\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if (strcmp(argv[i], "--buffer") == 0) { /* size of the output buffer */
+      if (i+1 < argc) {
+        calc = strtoul(argv[i+1], &endptr, 10);
+        for (temp = 0; endptr[temp] != '\0'; temp++)
+          endptr[temp] = tolower(endptr[temp]);
+
+        if (strcmp(endptr, "kb") == 0) outsize = 1000;
+        else if (strcmp(endptr, "mb") == 0) outsize = 1000000;
+        else if (strcmp(endptr, "kib") == 0) outsize = 1024;
+        else if (strcmp(endptr, "mib") == 0) outsize = 1048576;
+        else if (*endptr == '\0') outsize = 1;
+        else outsize = 0;
+
+        if (endptr == argv[i+1] || outsize == 0 || calc == 0 || calc > 1073741824UL/outsize) {
+          fprintf(stderr,"--buffer must be followed by a size between 1 and 1024mib\n");
+          exit(EXIT_FAILURE);
+        }
+        outsize *= calc;
+      }
+      else {
+        fprintf(stderr,"Please specify the size of the output buffer\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if (strcmp(argv[i], "--flush") == 0) { /* longest time output may sit in the buffer */
+      if (i+1 < argc) {
+        flush_ms = strtol(argv[i+1], &endptr, 10);
+        if (endptr == argv[i+1] || *endptr != '\0' || flush_ms < 0) {
+          fprintf(stderr,"--flush must be followed by a number of milliseconds\n");
+          exit(EXIT_FAILURE);
+        }
+      }
+      else {
+        fprintf(stderr,"Please specify the number of milliseconds\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if (strcmp(argv[i], "--checkpoint") == 0) { /* keep START.ckpt up to date */
+      if (i+1 < argc) {
+        checkpoint_ms = strtol(argv[i+1], &endptr, 10);
+        if (endptr == argv[i+1] || *endptr != '\0' || checkpoint_ms <= 0 || checkpoint_ms > LONG_MAX/1000) {
+          fprintf(stderr,"--checkpoint must be followed by a number of seconds greater than 0\n");
+          exit(EXIT_FAILURE);
+        }
+        checkpoint_ms *= 1000;
+      }
+      else {
+        fprintf(stderr,"Please specify the number of seconds\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if (strcmp(argv[i], "--shard") == 0) { /* i-th of N equal slices */
+      if (i+1 < argc) {
+        shard_index = strtoull(argv[i+1], &endptr, 10);
+        if (endptr != argv[i+1] && *endptr == '/' && isdigit((unsigned char)endptr[1]))
+          shard_count = strtoull(endptr+1, &endptr, 10);
+        if (!isdigit((unsigned char)argv[i+1][0]) || *endptr != '\0' || shard_count == 0 || shard_index == 0 || shard_index > shard_count) {
+          fprintf(stderr,"--shard must be followed by i/N where 1 <= i <= N\n");
+          exit(EXIT_FAILURE);
+        }
+        seek = 1;
+      }
+      else {
+        fprintf(stderr,"Please specify the shard as i/N\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if (strcmp(argv[i], "--offset") == 0) { /* number of words to skip */
+      if (i+1 < argc) {
+        seek_offset = strtoull(argv[i+1], &endptr, 10);
+        if (!isdigit((unsigned char)argv[i+1][0]) || *endptr != '\0') {
+          fprintf(stderr,"--offset must be followed by a number\n");
           exit(EXIT_FAILURE);
         }
+        seek = 1;
       }
       else {
-        fprintf(stderr,"Only gzip, bzip2, lzma, and 7z are supported\n");
+        fprintf(stderr,"Please specify the number of words to skip\n");
         exit(EXIT_FAILURE);
       }
     }
@@ -810,6 +1055,52 @@ int crunch(){
     }
   }
 
+  split_out = (jobs > 1 && (linecount > 0 || bytecount > 0));
+  if (split_out == 1 && outputfilename == NULL) {
+    fprintf(stderr,"-j with -c or -b needs -o\n");
+    exit(EXIT_FAILURE);
+  }
+  if (split_out == 1 && (resume == 1 || mmap_out == 1 || uring_out == 1 || direct_out == 1 || zindex == 1)) {
+    fprintf(stderr,"-j with -c or -b can't be used with -r, --mmap, --uring, --direct or --zindex\n");
+    exit(EXIT_FAILURE);
+  }
+  if (mmap_out == 1 && (flag == 1 || outputfilename == NULL)) {
+    fprintf(stderr,"--mmap needs -o and can't be used with -p or -q\n");
+    exit(EXIT_FAILURE);
+  }
+  if (uring_out == 1 && (mmap_out == 1 || outputfilename == NULL)) {
+    fprintf(stderr,"--uring needs -o and can't be used with --mmap\n");
+    exit(EXIT_FAILURE);
+  }
+  if (direct_out == 1 && (mmap_out == 1 || uring_out == 1 || outputfilename == NULL)) {
+    fprintf(stderr,"--direct needs -o and can't be used with --mmap or --uring\n");
+    exit(EXIT_FAILURE);
+  }
+  if (compressalgo != NULL && (mmap_out == 1 || uring_out == 1 || direct_out == 1)) {
+    fprintf(stderr,"-z can't be used with --mmap, --uring or --direct\n");
+    exit(EXIT_FAILURE);
+  }
+  if ((zjobs > 0 || zindex == 1) && (compressalgo == NULL || outputfilename == NULL)) {
+    fprintf(stderr,"--zjobs and --zindex need -o and -z\n");
+    exit(EXIT_FAILURE);
+  }
+  if (pwrite_out == 1 && (outputfilename == NULL || bytecount > 0 || linecount > 0 || compressalgo != NULL || mmap_out == 1 || uring_out == 1 || direct_out == 1 || manifest != NULL)) {
+    fprintf(stderr,"--pwrite needs -o and can't be used with -b, -c, -z, --mmap, --uring, --direct or --manifest\n");
+    exit(EXIT_FAILURE);
+  }
+  if (checkpoint_ms > 0 && (outputfilename == NULL || flag == 1 || compressalgo != NULL || mmap_out == 1 || uring_out == 1 || direct_out == 1 || pwrite_out == 1 || split_out == 1)) {
+    fprintf(stderr,"--checkpoint needs -o and can't be used with -p, -q, -z, --mmap, --uring, --direct, --pwrite or -c or -b with -j\n");
+    exit(EXIT_FAILURE);
+  }
+  if (pwrite_out == 1 && flag == 1) {
+    fprintf(stderr,"permute doesn't support --pwrite\n");
+    exit(EXIT_FAILURE);
+  }
+  if (jobs > 1 && flag == 1) {
+    fprintf(stderr,"permute doesn't support -j\n");
+    exit(EXIT_FAILURE);
+  }
+
   if (tempfilename != NULL) {
     if ((bytecount > 0) && (strcmp(tempfilename, "START") != 0)) {
       fprintf(stderr,"you must use -o START if you specify a count\n");
@@ -897,11 +1188,6 @@ int crunch(){
         exit(EXIT_FAILURE);
       }
 
-  if (endstring && too_many_duplicates(endstring, options)) {
-    fprintf(stderr,"Error: End string set by -e will never occur (too many duplicate chars)\n");
-    exit(EXIT_FAILURE);
-  }
-
   if (saw_unicode_input) {
     char response[8];
     fprintf(stderr,
@@ -927,15 +1213,61 @@ int crunch(){
   fill_minmax_strings(&options);
   fill_pattern_info(&options);
 
+  if (endstring && too_many_duplicates(endstring, wcslen(endstring), &options)) {
+    fprintf(stderr,"Error: End string set by -e will never occur (too many duplicate chars)\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* a terminal gets to see the words as they come, a pipe or file gets
+     them in big writes */
+  if (flush_ms == -1)
+    flush_ms = (outputfilename == NULL && isatty(STDOUT_FILENO)) ? 100 : 0;
+  out_init(outsize, flush_ms);
+  if (vmsplice_out == 1 && outputfilename == NULL)
+    out_vmsplice();
+  if (mmap_out == 1)
+    out_mmap();
+  if (uring_out == 1)
+    out_uring();
+  if (direct_out == 1)
+    out_direct();
+  if (compressalgo != NULL && outputfilename != NULL)
+    out_compress(compressalgo); /* before resume, which may have to decompress START */
+  if (manifest != NULL && outputfilename == NULL) {
+    fprintf(stderr,"--manifest needs -o\n");
+    exit(EXIT_FAILURE);
+  }
+  if (zindex == 1 && out.z == NULL) {
+    fprintf(stderr,"--zindex: crunch was built without the library for %s\n", compressalgo);
+    exit(EXIT_FAILURE);
+  }
+  if (out.z == NULL && zjobs > 0)
+    maxzprogs = zjobs; /* the programs run in the background instead */
+  else if (zjobs > 0 || zindex == 1) {
+    if (out.z->algo == OUT_LZMA) {
+      fprintf(stderr,"--zjobs and --zindex can't be used with -z lzma, whose files hold a single stream.  Try -z xz\n");
+      exit(EXIT_FAILURE);
+    }
+    out_zpool(zjobs > 0 ? zjobs : 1); /* --zindex needs the blocks */
+    out.z->indexed = zindex;
+  }
+  if (split_out == 1 && out.z != NULL && out.z->algo == OUT_LZMA) {
+    fprintf(stderr,"-j with -c or -b can't be used with -z lzma, whose files hold a single stream.  Try -z xz\n");
+    exit(EXIT_FAILURE);
+  }
+  if (manifest != NULL)
+    crc_init();
+
   if (resume == 1) {
     if (startblock != NULL) {
       fprintf(stderr,"you cannot specify a startblock and resume\n");
       exit(EXIT_FAILURE);
     }
     if (flag == 0) {
-      startblock = resumesession(fpath, charset);
+      startblock = resumesession(fpath, &options);
       min = wcslen(startblock);
-      increment(startblock, options);
+      count_inc(startblock, wcslen(startblock), &options);
+      (void)increment(startblock, wcslen(startblock), &options);
     }
     if (flag == 1) {
       fprintf(stderr,"permute doesn't support resume\n");
@@ -943,8 +1275,78 @@ int crunch(){
     }
   }
   else {
-    if (fpath != NULL)
+    if (fpath != NULL) {
       (void)remove(fpath);
+      ckpt = checkpoint_name(fpath); /* and what an earlier -r would have used */
+      (void)remove(ckpt);
+      free(ckpt);
+    }
+  }
+
+  if (seek == 1) {
+    if (flag == 1) {
+      fprintf(stderr,"permute doesn't support --offset, --count or --shard\n");
+      exit(EXIT_FAILURE);
+    }
+    if (resume == 1) {
+      fprintf(stderr,"you cannot use --offset, --count or --shard and resume\n");
+      exit(EXIT_FAILURE);
+    }
+
+    /* turn the word range into -s and -e so the rest of crunch needs no
+       changes.  The last word may be shorter than max, max shrinks with it */
+    seek_total = count_keyspace(&options);
+    if (seek_offset >= seek_total) {
+      fprintf(stderr,"--offset %llu is past the last word, there are only %llu\n", seek_offset, seek_total);
+      exit(EXIT_FAILURE);
+    }
+    if (seek_count == 0 || seek_count > seek_total - seek_offset)
+      seek_count = seek_total - seek_offset;
+
+    /* --shard cuts the range into N runs that differ by at most one word,
+       the first ones get the extra words.  Only needs the exact total so
+       every node agrees on the cut without talking to the others */
+    if (shard_count > 0) {
+      if (seek_count == ULLONG_MAX) {
+        fprintf(stderr,"the keyspace is too large to count, cannot split it into shards\n");
+        exit(EXIT_FAILURE);
+      }
+      temp_ull = seek_count % shard_count;
+      seek_offset += (seek_count / shard_count) * (shard_index-1) + (shard_index-1 < temp_ull ? shard_index-1 : temp_ull);
+      seek_count = seek_count / shard_count + (shard_index-1 < temp_ull ? 1 : 0);
+      if (seek_count == 0) {
+        fprintf(stderr,"shard %llu/%llu is empty, there are only %llu words\n", shard_index, shard_count, seek_total);
+        exit(EXIT_SUCCESS);
+      }
+    }
+
+    tempwcs = calloc(max+1, sizeof(wchar_t));
+    if (tempwcs == NULL) {
+      fprintf(stderr,"crunch: can't allocate memory for startblock\n");
+      exit(EXIT_FAILURE);
+    }
+    min = unrank_keyspace(tempwcs, seek_offset, &options);
+
+    if (seek_offset + seek_count < seek_total) {
+      wchar_t *lastword = calloc(max+1, sizeof(wchar_t));
+      if (lastword == NULL) {
+        fprintf(stderr,"crunch: can't allocate memory for endstring\n");
+        exit(EXIT_FAILURE);
+      }
+      max = unrank_keyspace(lastword, seek_offset + seek_count - 1, &options);
+      free(endstring);
+      endstring = lastword;
+    }
+    free(startblock);
+    startblock = tempwcs;
+
+    free_pattern_info(&options);
+    options.startstring = startblock;
+    options.endstring = endstring;
+    options.min = min;
+    options.max = max;
+    fill_minmax_strings(&options);
+    fill_pattern_info(&options);
   }
 
   if (flag == 0) { /* chunk */
@@ -1005,7 +1407,23 @@ int crunch(){
     my_thread.finalfilesize+=my_thread.bytetotal;
     my_thread.linecounter = 0;
 
-    chunk(min, max, startblock, options, fpath, outputfilename, compressalgo);
+    manifest_options = &options; /* the manifest numbers the words */
+    if (checkpoint_ms > 0) {
+      checkpoint_fpath = fpath;
+      checkpoint_options = &options;
+      (void)clock_gettime(CLOCK_MONOTONIC, &checkpoint_last);
+    }
+    if (split_out == 1)
+      chunk_split(min, max, startblock, options, fpath, compressalgo, jobs);
+    else if (pwrite_out == 1)
+      chunk_pwrite(min, max, startblock, options, fpath, outputfilename, jobs);
+    else if (jobs > 1)
+      chunk_jobs(min, max, startblock, options, fpath, outputfilename, compressalgo, jobs);
+    else
+      chunk(min, max, startblock, options, fpath, outputfilename, compressalgo);
+    checkpoint_fpath = NULL;
+    if (ctrlbreak && outputfilename != NULL && out.z == NULL && split_out == 0)
+      checkpoint_write(fpath, &options); /* for -r */
   }
   else { /* permute */
     my_thread.finallinecount = 1;
@@ -1127,6 +1545,11 @@ int crunch(){
       renamefile(((size_t)(my_thread.finallinecount*2)+5), fpath, outputfilename, compressalgo);
   }
 
+  if (out.fd >= 0)
+    out_flush();
+  out_free();
+  zprog_reap(0);
+
   if (wordarray) {
     for (temp = 0; temp < numofelements; temp++)
       free(wordarray[temp]);
@@ -1147,11 +1570,7 @@ int crunch(){
   free(endstring);
   free(literalstring);
 
-  free(options.last_min);
-  free(options.first_max);
-  free(options.min_string);
-  free(options.max_string);
-  free(options.pattern_info);
+  free_pattern_info(&options);
 
   return 0;
 }
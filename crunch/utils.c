@@ -149,6 +149,55 @@ static wchar_t *dupwcs(const wchar_t *s) {
   return p;
 }
 
+static size_t encode_char(char *out, wchar_t wc) {
+  /* writes the output bytes for wc the same way make_narrow_string would, returns the count */
+  int mblen = 1;
+
+  if (output_unicode != 0) {
+    mblen = wctomb(out,wc);
+    if (mblen == -1) {
+      fprintf(stderr,"Error: wctomb failed for char U+%04lX\n",(unsigned long)wc);
+      exit(EXIT_FAILURE);
+    }
+  }
+  else
+    out[0] = (char)(wc&0xFF);
+
+  return (size_t)mblen;
+}
+
+static void fill_symtab(struct symtab *st, wchar_t *cset, size_t clen) {
+  /*
+  Convert every character of cset to output bytes once at startup so
+  chunk() can copy them straight into the output line instead of
+  converting the whole word with make_narrow_string() every time.
+  */
+  size_t i;
+
+  st->cset = cset;
+  st->clen = clen;
+  for (i = 0; i < 256; i++)
+    st->rev[i] = NPOS;
+  for (i = 0; i < clen; i++)
+    if ((unsigned long)cset[i] < 256 && st->rev[cset[i]] == NPOS)
+      st->rev[cset[i]] = i;
+
+  st->width = (output_unicode != 0) ? (size_t)MB_CUR_MAX : 1;
+  st->bytes = calloc(clen ? clen*st->width : 1, sizeof(char));
+  st->len = calloc(clen ? clen : 1, sizeof(unsigned char));
+  if (st->bytes == NULL || st->len == NULL) {
+    fprintf(stderr,"fill_symtab: can't allocate memory for symbol table\n");
+    exit(EXIT_FAILURE);
+  }
+
+  st->uniform = 1;
+  for (i = 0; i < clen; i++) {
+    st->len[i] = (unsigned char)encode_char(&st->bytes[i*st->width], cset[i]);
+    if (st->len[i] != st->len[0])
+      st->uniform = 0;
+  }
+}
+
 /* return 0 if string1 does not comply with options.pattern and options.literalstring */
 static int check_member(const wchar_t *string1, const options_type* options) {
 const wchar_t *cset;
@@ -194,6 +243,13 @@ size_t i;
   return 1;
 }
 
+/* find_index for a charset with a symtab, chars below 256 are a table lookup */
+static size_t symtab_index(const struct symtab *st, wchar_t c) {
+  if ((unsigned long)c < 256)
+    return st->rev[c];
+  return find_index(st->cset, st->clen, c);
+}
+
 /* NOTE: similar to strpbrk but length limited and only searches for a single char */
 static size_t find_index(const wchar_t *cset, size_t clen, wchar_t tofind) {
   size_t i;
@@ -300,6 +356,7 @@ static void fill_pattern_info(options_type *options) {
   size_t i, clen, index, si, ei;
   int is_fixed;
   size_t dupes;
+  const struct symtab *syms;
 
   options->pattern_info = calloc(options->max, sizeof(struct pinfo));
   if (options->pattern_info == NULL) {
@@ -307,16 +364,24 @@ static void fill_pattern_info(options_type *options) {
     exit(EXIT_FAILURE);
   }
 
+  fill_symtab(&options->symtabs[0], options->low_charset, options->clen);
+  fill_symtab(&options->symtabs[1], options->upp_charset, options->ulen);
+  fill_symtab(&options->symtabs[2], options->num_charset, options->nlen);
+  fill_symtab(&options->symtabs[3], options->sym_charset, options->slen);
+  options->uniform_width = 1;
+
   for (i = 0; i < options->max; i++) {
     cset = NULL;
     clen = 0;
     index = 0;
     is_fixed = 1;
     dupes = options->duplicates[0];
+    syms = NULL;
     if (options->pattern == NULL) {
       cset = options->low_charset;
       clen = options->clen;
       is_fixed = 0;
+      syms = &options->symtabs[0];
     }
     else {
       cset = NULL;
@@ -327,6 +392,7 @@ static void fill_pattern_info(options_type *options) {
             clen = options->clen;
             is_fixed = 0;
             dupes = options->duplicates[0];
+            syms = &options->symtabs[0];
           }
           break;
         case L',':
@@ -335,6 +401,7 @@ static void fill_pattern_info(options_type *options) {
             clen = options->ulen;
             is_fixed = 0;
             dupes = options->duplicates[1];
+            syms = &options->symtabs[1];
           }
           break;
         case L'%':
@@ -343,6 +410,7 @@ static void fill_pattern_info(options_type *options) {
             clen = options->nlen;
             is_fixed = 0;
             dupes = options->duplicates[2];
+            syms = &options->symtabs[2];
           }
           break;
         case L'^':
@@ -351,6 +419,7 @@ static void fill_pattern_info(options_type *options) {
             clen = options->slen;
             is_fixed = 0;
             dupes = options->duplicates[3];
+            syms = &options->symtabs[3];
           }
           break;
         default: /* constant part of pattern */
@@ -422,8 +491,16 @@ static void fill_pattern_info(options_type *options) {
     p->start_index = si;
     p->end_index = ei;
     p->duplicates = dupes;
+    p->syms = syms;
+    p->is_literal = (is_fixed && options->pattern != NULL && wcschr(L"@,%^", options->pattern[i]) != NULL);
+    if (is_fixed)
+      p->fixedlen = encode_char(p->fixed, options->pattern[i]);
+    else if (syms->uniform == 0)
+      options->uniform_width = 0;
   }
 
+  fill_plan(options);
+
 #ifdef DEBUG
   printf("pattern_info duplicates: ");
   for (i = 0; i < options->max; i++) {
@@ -434,180 +511,2072 @@ static void fill_pattern_info(options_type *options) {
 #endif
 }
 
-static unsigned long long fill_next_count(size_t si, size_t ei, int repeats, unsigned long long sum, /*@null@*/ unsigned long long *current_count, /*@out@*/ unsigned long long *next_count, size_t len) {
-size_t i;
-unsigned long long nextsum = 0;
+/* keep only the variable positions of pattern_info, in the form the per word functions want */
+static void fill_plan(options_type *options) {
+  struct plan *pl;
+  struct pvar *v;
+  const struct pinfo *p;
+  size_t i, c, k;
+
+  pl = calloc(1, sizeof(struct plan));
+  if (pl != NULL)
+    pl->vars = calloc(options->max ? options->max : 1, sizeof(struct pvar));
+  if (pl == NULL || pl->vars == NULL) {
+    fprintf(stderr,"fill_plan: can't allocate memory for plan\n");
+    exit(EXIT_FAILURE);
+  }
 
-  for (i = 0; i < si; i++)
-    next_count[i] = 0;
+  k = 0;
+  for (i = 0; i < options->max; i++) {
+    pl->nvars_len[i] = k;
+    p = &options->pattern_info[i];
+    pl->vindex[i] = NPOS;
+    if (p->is_fixed)
+      continue;
+    pl->vindex[i] = k;
+    v = &pl->vars[k++];
+    v->pos = i;
+    v->cset = p->cset;
+    v->clen = p->clen;
+    v->end_index = p->end_index;
+  }
+  pl->nvars_len[options->max] = k;
+
+  pl->check_dupes = 0;
+  for (k = 0; k < 4; k++)
+    if (options->duplicates[k] != (size_t)-1)
+      pl->check_dupes = 1;
+
+  for (c = 0; c < 256; c++) {
+    pl->dupe_limit[c] = (size_t)-1;
+    for (k = 0; k < 4; k++)
+      if (options->symtabs[k].rev[c] != NPOS && options->duplicates[k] < pl->dupe_limit[c])
+        pl->dupe_limit[c] = options->duplicates[k];
+  }
 
-  if (repeats == 0 || current_count == NULL)
-    nextsum = sum;
-  else if (repeats == 1)
-    for (; i <= ei; i++) {
-      next_count[i] = sum - current_count[i];
-      nextsum += next_count[i];
+  options->plan = pl;
+}
+
+/* undo fill_minmax_strings and fill_pattern_info */
+static void free_pattern_info(options_type *options) {
+  size_t k;
+
+  free(options->last_min);
+  free(options->first_max);
+  free(options->min_string);
+  free(options->max_string);
+  free(options->pattern_info);
+  if (options->plan != NULL)
+    free(options->plan->vars);
+  free(options->plan);
+  for (k = 0; k < 4; k++) {
+    free(options->symtabs[k].bytes);
+    free(options->symtabs[k].len);
+  }
+  options->last_min = options->first_max = options->min_string = options->max_string = NULL;
+  options->pattern_info = NULL;
+  options->plan = NULL;
+  memset(options->symtabs, 0, sizeof(options->symtabs));
+}
+
+/* render positions from..len-1 of the word held in inc[] into out starting at
+   off[from], recording where each position begins in off[] and ending the line
+   with a newline.  Returns the number of bytes in the word, not counting the
+   newline */
+static size_t render_word(char *out, size_t *off, size_t from, size_t len, const options_type *options) {
+const struct pinfo *p = &options->pattern_info[from];
+const struct symtab *st;
+size_t i, n = (from == 0) ? 0 : off[from];
+
+  for (i = from; i < len; i++, p++) {
+    off[i] = n;
+    if (p->is_fixed) {
+      memcpy(&out[n], p->fixed, p->fixedlen);
+      n += p->fixedlen;
     }
-  else /* repeats > 1 */
-    for (; i <= ei; i++) {
-      next_count[i] = current_count[i];
-      nextsum += next_count[i];
+    else if ((st = p->syms)->width == 1)
+      out[n++] = st->bytes[inc[i]];
+    else {
+      memcpy(&out[n], &st->bytes[inc[i]*st->width], st->len[inc[i]]);
+      n += st->len[inc[i]];
     }
+  }
+  off[len] = n;
+  out[n] = '\n';
 
-  for (; i < len; i++)
-    next_count[i] = 0;
+  return n;
+}
 
-  return nextsum;
+/* bring a line from render_word() up to date after increment() returned pos.
+   Only the positions increment() touched are written again */
+static size_t rerender_word(char *out, size_t *off, size_t pos, size_t len, const options_type *options) {
+const struct symtab *st;
+size_t i;
+
+  if (pos == NPOS) /* wrapped around, every position changed */
+    return render_word(out, off, 0, len, options);
+
+  if (inverted == 0) /* pos..len-1 changed */
+    return render_word(out, off, pos, len, options);
+
+  /* inverted: 0..pos changed.  if no offset can move they are rewritten in place */
+  if (options->uniform_width == 0)
+    return render_word(out, off, 0, len, options);
+
+  for (i = 0; i <= pos; i++) {
+    if (options->pattern_info[i].is_fixed)
+      continue;
+    st = options->pattern_info[i].syms;
+    memcpy(&out[off[i]], &st->bytes[inc[i]*st->width], st->len[inc[i]]);
+  }
+  return off[len];
 }
 
-/* calculate the number of strings from start to end taking into account duplicate removal worst case: O(2^n), could be improved using memoize */
-static unsigned long long calculate_with_dupes(int start_point, int end_point, size_t first, size_t last, size_t pattern_index, int repeats, unsigned long long current_sum, /*@null@*/ unsigned long long *current_count, const options_type options, size_t plen) {
-/* start_point and end_point are bools */
+static void fill_sweep_scalar(char *out, const char *line, size_t linelen, size_t pos, const char *syms, size_t n) {
+size_t k;
 
-  unsigned long long count[MAXCSET];
-  unsigned long long *next_count;
-  unsigned long long total = 0, sum = 0;
-  size_t start_index, end_index;
-  size_t i;
+  for (k = 0; k < n; k++, out += linelen) {
+    memcpy(out, line, linelen);
+    out[pos] = syms[k];
+  }
+}
 
-  if (first == NPOS || last == NPOS || first > last || pattern_index > plen) /* sanity check */
-    return 0;
+#ifdef HAVE_SWEEP_SIMD
+/* one unaligned store per line, the bytes past linelen are overwritten by the next line */
+__attribute__((target("sse4.2")))
+static void fill_sweep_sse(char *out, const char *line, size_t linelen, size_t pos, const char *syms, size_t n) {
+__m128i tmpl = _mm_loadu_si128((const __m128i*)line);
+__m128i mask = _mm_cmpeq_epi8(_mm_setr_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15), _mm_set1_epi8((char)pos));
+size_t k;
 
-   /* check for too many duplicates */
-  if (pattern_index > 0 && (size_t)repeats > options.pattern_info[pattern_index-1].duplicates) {
-    return 0;
+  for (k = 0; k < n; k++, out += linelen)
+    _mm_storeu_si128((__m128i*)out, _mm_blendv_epi8(tmpl, _mm_set1_epi8(syms[k]), mask));
+}
+
+__attribute__((target("avx2")))
+static void fill_sweep_avx2(char *out, const char *line, size_t linelen, size_t pos, const char *syms, size_t n) {
+__m256i tmpl = _mm256_loadu_si256((const __m256i*)line);
+__m256i mask = _mm256_cmpeq_epi8(_mm256_setr_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
+                                                  16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31), _mm256_set1_epi8((char)pos));
+size_t k;
+
+  for (k = 0; k < n; k++, out += linelen)
+    _mm256_storeu_si256((__m256i*)out, _mm256_blendv_epi8(tmpl, _mm256_set1_epi8(syms[k]), mask));
+}
+#endif
+
+/* write n copies of the linelen byte line to out, copy k having syms[k] at
+   byte pos.  line must be readable and out writable for SWEEP_SLACK bytes past
+   the end */
+static void fill_sweep(char *out, const char *line, size_t linelen, size_t pos, const char *syms, size_t n) {
+#ifdef HAVE_SWEEP_SIMD
+static int isa = -1; /* 0 scalar, 1 sse4.2, 2 avx2 */
+
+  if (isa == -1)
+    isa = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("sse4.2") ? 1 : 0;
+
+  if (isa >= 1 && linelen <= 16) {
+    fill_sweep_sse(out, line, linelen, pos, syms, n);
+    return;
   }
+  if (isa == 2 && linelen <= 32) {
+    fill_sweep_avx2(out, line, linelen, pos, syms, n);
+    return;
+  }
+#endif
+  fill_sweep_scalar(out, line, linelen, pos, syms, n);
+}
 
-  /* create the result count for pattern_index - 1 */
-  if (pattern_index == 0) {
-    sum = current_sum;
-    next_count = NULL;
+/*
+  -i version of sweep_word.  The first positions change fastest, so take
+  as many of them as fit in TILE_BYTES and write the whole block column by
+  column: every line gets the current word, then position 0 cycles through
+  its charset down the block, then position 1 once every clen0 lines, and so
+  on.  The block stops one short of the word with all of them on their last
+  character, which is left in block2, inc[] and line for increment() to
+  carry out of.  Only starts a block when those positions are all on their
+  first character, otherwise sweeps position 0 alone like sweep_word.
+  Returns the number of lines written, 0 if more than maxlines.  buf has
+  room bytes, plus SWEEP_SLACK.
+*/
+static size_t sweep_tile(char *buf, size_t room, wchar_t *block2, char *line, const size_t *off, size_t len, const options_type *options, unsigned long long maxlines) {
+const struct pvar *vars = options->plan->vars;
+const struct pvar *v;
+size_t nv = options->plan->nvars_len[len];
+size_t linelen = off[len]+1;
+size_t d, j, c, t, r, n, step;
+size_t words = 1;
+char *out;
+const char *syms;
+
+  for (d = 0; d < nv; d++) {
+    v = &vars[d];
+    if (inc[v->pos] != 0 || options->pattern_info[v->pos].syms->width != 1)
+      break;
+    if (words*v->clen > TILE_BYTES/linelen || words*v->clen-1 > maxlines)
+      break;
+    words *= v->clen;
   }
-  else if (pattern_index == 1 ||
-      (options.pattern_info[pattern_index-1].cset != NULL &&
-      options.pattern_info[pattern_index-2].cset != options.pattern_info[pattern_index-1].cset) ||
-      (options.pattern_info[pattern_index-1].cset == NULL &&
-      options.pattern[pattern_index-2] != options.pattern[pattern_index-1])) {
-    /* beginning new cset */
-    if (repeats > 1) {
+
+  if (d < 2) { /* position 0 alone, from wherever it is */
+    v = &vars[0];
+    c = inc[v->pos];
+    n = v->clen-1 - c;
+    if (n == 0 || n > maxlines)
       return 0;
-    }
-    if (options.pattern_info[pattern_index-1].cset != NULL) {
-      for (i = 0; i < first; i++)
-        count[i] = 0;
-      for (; i <= last; i++)
-        count[i] = current_sum;
-      for (; i < options.pattern_info[pattern_index-1].clen; i++)
-        count[i] = 0;
-      next_count = count;
-    } else
-      next_count = NULL;
-    sum = current_sum * (last - first + 1);
-  }
-  else if (options.pattern_info[pattern_index-1].cset == NULL &&
-      options.pattern[pattern_index-2] == options.pattern[pattern_index-1]) {
-    /* continuing unknown cset */
-    sum = current_sum;
-    next_count = NULL;
+    assert(n <= room/linelen);
+    fill_sweep(buf, line, linelen, off[v->pos], &options->pattern_info[v->pos].syms->bytes[c], n);
+    d = 1;
   }
   else {
-    /* continuing previous cset */
-    sum = fill_next_count(first, last, repeats, current_sum, current_count, count, options.pattern_info[pattern_index-1].clen);
-    next_count = count;
+    n = words-1;
+    assert(n <= room/linelen);
+    /* the template and column 0 in one pass, clen0 lines at a time */
+    v = &vars[0];
+    syms = options->pattern_info[v->pos].syms->bytes;
+    for (r = 0; r < n; r += v->clen)
+      fill_sweep(&buf[r*linelen], line, linelen, off[v->pos], syms, (n-r < v->clen) ? n-r : v->clen);
+
+    for (j = 1, step = v->clen; j < d; step *= vars[j].clen, j++) {
+      v = &vars[j];
+      syms = options->pattern_info[v->pos].syms->bytes;
+      out = &buf[off[v->pos]];
+      for (r = 0, c = 0; r < n; c = (c+1 == v->clen) ? 0 : c+1)
+        for (t = 0; t < step && r < n; t++, r++, out += linelen)
+          *out = syms[c];
+    }
   }
 
-  if (sum == 0) {
+  for (j = 0; j < d; j++) {
+    v = &vars[j];
+    move_inc(v, inc[v->pos], v->clen-1);
+    inc[v->pos] = v->clen-1;
+    block2[v->pos] = v->cset[v->clen-1];
+    line[off[v->pos]] = options->pattern_info[v->pos].syms->bytes[v->clen-1];
+  }
+  return n;
+}
+
+/* bool. sweep_word may be used for words of length len.  The position
+   that changes fastest must be variable and render to a single byte, and
+   without -i it must be the last one */
+static int sweep_ok(size_t len, const options_type *options) {
+const struct plan *pl = options->plan;
+size_t nv = pl->nvars_len[len];
+size_t pos;
+
+  if (nv == 0 || pl->check_dupes)
+    return 0;
+  pos = pl->vars[inverted ? 0 : nv-1].pos;
+  if (inverted == 0 && pos != len-1)
+    return 0;
+  return options->pattern_info[pos].syms->width == 1;
+}
+
+/*
+  With no -d, -e or -i the last position runs through its whole charset
+  while the rest of the word stays put.  Write the lines from the current
+  word up to, but not including, the one ending in the last character of the
+  charset into buf and leave block2, inc[] and the rendered line on that
+  word.  Returns the number of lines written, 0 if more than maxlines.
+  buf has room bytes, plus SWEEP_SLACK for the vector stores past the end.
+  -i is handed to sweep_tile.
+*/
+static size_t sweep_word(char *buf, size_t room, wchar_t *block2, char *line, const size_t *off, size_t len, const options_type *options, unsigned long long maxlines) {
+const struct pinfo *p = &options->pattern_info[len-1];
+const struct pvar *v = &options->plan->vars[options->plan->nvars_len[len]-1];
+size_t first = inc[len-1];
+size_t last = p->clen-1;
+size_t n = last - first;
+
+  if (inverted)
+    return sweep_tile(buf, room, block2, line, off, len, options, maxlines);
+
+  if (n == 0 || n > maxlines)
     return 0;
+  assert(n <= room/(off[len]+1));
+
+  fill_sweep(buf, line, off[len]+1, off[len-1], &p->syms->bytes[first], n);
+
+  move_inc(v, first, last);
+  inc[len-1] = last;
+  block2[len-1] = p->cset[last];
+  line[off[len-1]] = p->syms->bytes[last];
+
+  return n;
+}
+
+/* bytes a sweep_word call may write for a line of outlen+1 bytes when no
+   position has more than maxclen characters: clen-1 lines at most.  The
+   vector stores also need SWEEP_SLACK past that, which out_reserve adds */
+static size_t sweep_room(size_t maxclen, size_t outlen) {
+size_t n = maxclen*(outlen+1);
+
+  if (inverted && n < TILE_BYTES)
+    return TILE_BYTES;
+  return n;
+}
+
+/* sweep_word straight into the output buffer and commit what it wrote.
+   Never more lines than fit, in case the buffer can't grow to sweep_room */
+static size_t out_sweep(wchar_t *block2, char *line, const size_t *off, size_t len, const options_type *options, size_t maxclen, unsigned long long maxlines) {
+size_t linelen = off[len]+1;
+char *buf = out_reserve(sweep_room(maxclen, off[len]));
+size_t room = out.size - out.len;
+size_t n;
+
+  if (maxlines > room/linelen)
+    maxlines = room/linelen;
+  if ((n = sweep_word(buf, room, block2, line, off, len, options, maxlines)) != 0)
+    out_commit(n*linelen);
+  return n;
+}
+
+static void out_init(size_t size, long flush_ms) {
+  out.size = size;
+  out.buf = malloc(size + SWEEP_SLACK);
+  if (out.buf == NULL) {
+    fprintf(stderr,"crunch: can't allocate memory for the output buffer\n");
+    exit(EXIT_FAILURE);
   }
+  out.len = 0;
+  out.flush_ms = flush_ms;
+  out.ticks = 0;
+  (void)clock_gettime(CLOCK_MONOTONIC, &out.last);
+}
 
-  if (pattern_index == plen) { /* check for the end of the pattern */
-    return sum;
+/* write a then b to out.fd, picking up after short writes.  Errors are
+   fatal, so nobody else has to check */
+static void out_writev(const char *a, size_t alen, const char *b, size_t blen) {
+struct iovec iov[2];
+int k = 0, n = 0;
+ssize_t r;
+
+  if (alen > 0) {
+    iov[n].iov_base = (void *)a;
+    iov[n++].iov_len = alen;
+  }
+  if (blen > 0) {
+    iov[n].iov_base = (void *)b;
+    iov[n++].iov_len = blen;
   }
 
-  if (options.pattern_info[pattern_index].is_fixed) {
-    start_index = end_index = options.pattern_info[pattern_index].start_index;
+  while (k < n) {
+    r = writev(out.fd, &iov[k], n-k);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr,"crunch: write failed = %d\n", errno);
+      fprintf(stderr,"The problem is = %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    out.pushed += (unsigned long long)r;
+    while (k < n && (size_t)r >= iov[k].iov_len)
+      r -= (ssize_t)iov[k++].iov_len;
+    if (k < n) {
+      iov[k].iov_base = (char *)iov[k].iov_base + r;
+      iov[k].iov_len -= (size_t)r;
+    }
   }
-  else {
-    start_index = 0;
-    end_index = options.pattern_info[pattern_index].clen - 1;
-    if (start_point)
-      start_index = options.pattern_info[pattern_index].start_index;
-    if (end_point)
-      end_index = options.pattern_info[pattern_index].end_index;
+}
+
+#ifdef HAVE_VMSPLICE
+/*
+  --vmsplice: hand the pages of buf to the pipe instead of copying them,
+  then move on to the next buffer.  The pipe only points at those pages,
+  so a buffer must not be written again until the reader has read every
+  byte of it.  Everything handed over after a buffer sits in front of it
+  in the pipe, so once the pipe holds no more than that the buffer is free.
+  With buffers of half the pipe that is true by the time the third one is
+  handed over and there is no wait.  Small flushes from --flush can make
+  it wait for the reader, like a full pipe would.
+  The pages are not gifted (SPLICE_F_GIFT): the kernel says a gift may
+  never be written again, and these are reused.
+*/
+static void out_splice(void) {
+struct iovec iov;
+struct timespec nap = { 0, 100000 };
+ssize_t r;
+int unread;
+
+  iov.iov_base = out.buf;
+  iov.iov_len = out.len;
+  while (iov.iov_len > 0) {
+    r = vmsplice(out.fd, &iov, 1, 0);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr,"crunch: vmsplice failed = %d\n", errno);
+      fprintf(stderr,"The problem is = %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    out.pushed += (unsigned long long)r;
+    iov.iov_base = (char *)iov.iov_base + r;
+    iov.iov_len -= (size_t)r;
   }
+  out.done_at[out.slot] = out.pushed;
 
-  if (start_index == end_index) {
-    /* [0..si..0](sp, ep) */
-    if (repeats > 0)
-      total += calculate_with_dupes(start_point, end_point, start_index, end_index, pattern_index + 1, repeats + 1, sum, next_count, options, plen);
-    total += calculate_with_dupes(start_point, end_point, start_index, end_index, pattern_index + 1, 1, sum, next_count, options, plen);
+  out.slot = (out.slot+1) % OUT_SLOTS;
+  out.buf = &out.pages[out.slot*out.stride];
+  while (ioctl(out.fd, FIONREAD, &unread) == 0 && (unsigned long long)unread > out.pushed - out.done_at[out.slot])
+    (void)nanosleep(&nap, NULL);
+}
+#endif
+
+static void out_flush(void) {
+  out_sum(&out.buf[out.seen], out.len - out.seen);
+  out_ends(&out.buf[out.seen], out.len - out.seen);
+  out.seen = out.len;
+
+  if (out.map) {
+    if (out.win != NULL)
+      out_map_at(out_unmap());
   }
+#ifdef HAVE_URING
+  else if (out.ring != NULL) {
+    if (out.len > 0)
+      uring_flush();
+  }
+#endif
+  else if (out.direct)
+    out_blocks();
   else {
-    if (start_point) {
-      /* [0..si..0](sp, 0) */
-      if (repeats > 0)
-        total += calculate_with_dupes(start_point, 0, start_index, start_index, pattern_index + 1, repeats + 1, sum, next_count, options, plen);
-      total += calculate_with_dupes(start_point, 0, start_index, start_index, pattern_index + 1, 1, sum, next_count, options, plen);
-      start_index++;
+    if (out.z != NULL && out.z->pool != NULL) {
+      if (out.len > 0)
+        out_zsubmit();
     }
+    else if (out.z != NULL)
+      out_zwrite(out.buf, out.len, 0);
+    else
+#ifdef HAVE_VMSPLICE
+    if (out.pages != NULL && out.len > 0)
+      out_splice();
+    else
+#endif
+    out_writev(out.buf, out.len, NULL, 0);
+    out.len = 0;
+    if (out.flush_ms != 0)
+      (void)clock_gettime(CLOCK_MONOTONIC, &out.last);
+  }
+  out.seen = out.len; /* --direct keeps an odd end */
+  out_checkpoint();
+}
 
-    if (end_point) {
-      /* [0..ei..0](0, ep) */
-      if (repeats > 0)
-        total += calculate_with_dupes(0, end_point, end_index, end_index, pattern_index + 1, repeats + 1, sum, next_count, options, plen);
-      total += calculate_with_dupes(0, end_point, end_index, end_index, pattern_index + 1, 1, sum, next_count, options, plen);
-      end_index--;
-    }
+/* keep the first and last bytes written to the file, so renamefile can
+   name it after its first and last words without reading it back */
+static void out_ends(const char *s, size_t n) {
+size_t k;
 
-    if (start_index <= end_index) {  /* middle */
-      /* [0..si..ei..0](0,0) */
-      if (repeats > 0)
-        total += calculate_with_dupes(0, 0, start_index, end_index, pattern_index + 1, repeats + 1, sum, next_count, options, plen);
-      total += calculate_with_dupes(0, 0, start_index, end_index, pattern_index + 1, 1, sum, next_count, options, plen);
-    }
+  if (out.headlen < OUT_ENDS) {
+    k = (n < OUT_ENDS - out.headlen) ? n : OUT_ENDS - out.headlen;
+    memcpy(&out.head[out.headlen], s, k);
+    out.headlen += k;
+  }
+  if (n >= OUT_ENDS) {
+    memcpy(out.tail, &s[n-OUT_ENDS], OUT_ENDS);
+    out.taillen = OUT_ENDS;
   }
+  else {
+    k = (out.taillen < OUT_ENDS - n) ? out.taillen : OUT_ENDS - n;
+    memmove(out.tail, &out.tail[out.taillen-k], k);
+    memcpy(&out.tail[k], s, n);
+    out.taillen = k+n;
+  }
+}
 
-  return total;
+/* size of the file, and for --manifest its lines and CRC-32 */
+static void out_sum(const char *s, size_t n) {
+const char *c = s, *e = s + n;
+
+  out.filebytes += n;
+  if (manifest == NULL)
+    return;
+  out.crc = crc_update(out.crc, s, n);
+  while ((c = memchr(c, '\n', (size_t)(e - c))) != NULL) {
+    out.filewords++;
+    c++;
+  }
 }
 
-/* calculate the number of strings from start to end O(n)  */
-static unsigned long long calculate_simple(const wchar_t *startstring, const wchar_t *endstring, const wchar_t *cset, size_t clen) {
-  unsigned long long total = 1;
-  size_t index1, index2;
+static void crc_init(void) {
+unsigned long c;
+int k, j;
 
-  for (; *endstring && *startstring; endstring++, startstring++) {
-    for (index1 = 0; cset[index1] != L'\0' && cset[index1] != *endstring;)
-      index1++;
-    if (cset[index1] == L'\0')
-      index1 -= 1;
-    for (index2 = 0; cset[index2] != L'\0' && cset[index2] != *startstring;)
-      index2++;
-    if (cset[index2] == L'\0')
-      index2 = 0;
-    total = (total - 1) * (unsigned long long)clen + (unsigned long long)index1 - (unsigned long long)index2 + 1;
+  for (k = 0; k < 256; k++) {
+    for (c = (unsigned long)k, j = 0; j < 8; j++)
+      c = (c & 1) ? 0xEDB88320UL ^ (c >> 1) : c >> 1;
+    crc_table[k] = c;
   }
-  return total;
 }
 
-/* calculate the number of strings from start to end, inclusive, taking into account the pattern O(n) */
-static unsigned long long calculate_with_pattern(const wchar_t *startstring, const wchar_t *endstring, const options_type options) {
-  unsigned long long total_strings = 1;
-  size_t temp, clen;
-  const wchar_t *cset;
-  size_t index1, index2;
+/* CRC-32 as zlib and zip compute it, crc is 0 to start */
+static unsigned long crc_update(unsigned long crc, const char *s, size_t n) {
+const unsigned char *p = (const unsigned char *)s;
 
-  if (options.pattern == NULL) {
-    return calculate_simple(startstring, endstring, options.low_charset, options.clen);
+  crc ^= 0xFFFFFFFFUL;
+  while (n-- > 0)
+    crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFFUL;
+}
+
+/* the first or the last whole line of the file, with its \n */
+static void out_end(char *line, size_t size, int last) {
+const char *s = last ? out.tail : out.head;
+size_t n = last ? out.taillen : out.headlen;
+size_t i = 0, j;
+
+  if (last) {
+    for (j = n; j > 0 && s[j-1] != '\n'; j--)
+      ;
+    for (i = (j > 0) ? j-1 : 0; i > 0 && s[i-1] != '\n'; i--)
+      ;
   }
+  else {
+    for (j = 0; j < n && s[j] != '\n'; j++)
+      ;
+    if (j < n)
+      j++;
+  }
+  if (j - i >= size)
+    j = i + size-1;
+  memcpy(line, &s[i], j-i);
+  line[j-i] = '\0';
+}
 
-  for (temp = 0; temp < options.plen; temp++) {
-    cset = NULL;
-    clen = 0;
-    switch (options.pattern[temp]) {
-      case L'@':
-        if (options.literalstring[temp] != L'@') {
-          clen = options.clen;
-          cset = options.low_charset;
+/* --vmsplice.  If stdout is a pipe make it as big as we are allowed and
+   switch to page aligned buffers out_splice can hand over.  Otherwise,
+   or if the pipe stays too small to bother, nothing changes */
+static void out_vmsplice(void) {
+#ifdef HAVE_VMSPLICE
+struct stat st;
+size_t page = (size_t)sysconf(_SC_PAGESIZE);
+size_t half;
+int want, got;
+void *pages;
+
+  if (fstat(out.fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+    return;
+
+  for (want = OUT_BYTES; want >= OUT_MIN_SPLICE*2 && fcntl(out.fd, F_SETPIPE_SZ, want) < 0; want /= 2)
+    ;
+  if ((got = fcntl(out.fd, F_GETPIPE_SZ)) < 0)
+    return;
+  half = ((size_t)got/2) / page * page;
+  if (half < OUT_MIN_SPLICE)
+    return;
+
+  /* the SWEEP_SLACK after each buffer gets its own page, so running over
+     never touches pages still in the pipe */
+  if (posix_memalign(&pages, page, OUT_SLOTS*(half+page)) != 0)
+    return;
+
+  out_flush();
+  free(out.buf);
+  out.pages = pages;
+  out.stride = half+page;
+  out.slot = 0;
+  out.buf = out.pages;
+  out.size = half;
+#endif
+}
+
+/* --mmap.  Files are written through a mapping, so the heap buffer goes */
+static void out_mmap(void) {
+  free(out.buf);
+  out.buf = NULL;
+  out.size = out.len = 0;
+  out.map = 1;
+}
+
+/* --direct.  Swap the buffer for an aligned one of whole blocks, with a
+   block to spare for what is left over after a flush.  Files out_open
+   opens from here on bypass the page cache */
+static void out_direct(void) {
+size_t size = (out.size < OUT_MIN_SPLICE) ? OUT_MIN_SPLICE : out.size;
+void *aligned;
+
+  size = (size + OUT_DIRECT_ALIGN-1) / OUT_DIRECT_ALIGN * OUT_DIRECT_ALIGN + OUT_DIRECT_ALIGN;
+  if (posix_memalign(&aligned, OUT_DIRECT_ALIGN, size + SWEEP_SLACK) != 0) {
+    fprintf(stderr,"crunch: can't allocate memory for the output buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  out_flush();
+  free(out.buf);
+  out.buf = aligned;
+  out.size = size;
+  out.direct = 1;
+}
+
+/* --direct: write the whole blocks in buf and move the odd bytes after
+   them to the front.  They go out with the next flush, or from out_close */
+static void out_blocks(void) {
+size_t whole = out.len / OUT_DIRECT_ALIGN * OUT_DIRECT_ALIGN;
+
+  if (whole > 0) {
+    out_writev(out.buf, whole, NULL, 0);
+    out.len -= whole;
+    memcpy(out.buf, &out.buf[whole], out.len);
+  }
+  if (out.flush_ms != 0)
+    (void)clock_gettime(CLOCK_MONOTONIC, &out.last);
+}
+
+/* -z.  Compress in process if crunch was built with the library for algo,
+   otherwise out.z stays NULL and renamefile runs the program */
+static void out_compress(const char *algo) {
+int id = 0;
+
+  (void)algo; /* unused when built without any of the libraries */
+#ifdef HAVE_ZLIB
+  if (strcmp(algo, "gzip") == 0)
+    id = OUT_GZIP;
+#endif
+#ifdef HAVE_BZLIB
+  if (strcmp(algo, "bzip2") == 0)
+    id = OUT_BZIP2;
+#endif
+#ifdef HAVE_LZMA
+  if (strcmp(algo, "lzma") == 0)
+    id = OUT_LZMA;
+  if (strcmp(algo, "xz") == 0)
+    id = OUT_XZ;
+#endif
+#ifdef HAVE_ZSTD
+  if (strcmp(algo, "zstd") == 0)
+    id = OUT_ZSTD;
+#endif
+#ifdef HAVE_LZ4
+  if (strcmp(algo, "lz4") == 0)
+    id = OUT_LZ4;
+#endif
+  if (id == 0)
+    return;
+
+  if ((out.z = calloc(1, sizeof(struct outz))) == NULL || (out.z->buf = malloc(OUT_Z_BYTES)) == NULL) {
+    fprintf(stderr,"crunch: can't allocate memory for compression\n");
+    exit(EXIT_FAILURE);
+  }
+  out.z->algo = id;
+}
+
+/* -z: start a stream at the top of an empty START file.  gzip, bzip2 and
+   lzma get the -9 the programs were always run with.  xz, zstd and lz4,
+   which were never run that way, get their defaults */
+static void out_zstart(void) {
+struct outz *z = out.z;
+int ok = (z->pool != NULL); /* each block starts its own */
+#ifdef HAVE_LZMA
+lzma_stream init = LZMA_STREAM_INIT;
+lzma_options_lzma opt;
+#endif
+#ifdef HAVE_LZ4
+LZ4F_preferences_t prefs;
+size_t n = 0;
+#endif
+
+  switch (ok ? 0 : z->algo) {
+#ifdef HAVE_ZLIB
+  case OUT_GZIP: /* 16 more window bits for a gzip header */
+    memset(&z->gz, 0, sizeof(z->gz));
+    ok = (deflateInit2(&z->gz, 9, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    break;
+#endif
+#ifdef HAVE_BZLIB
+  case OUT_BZIP2:
+    memset(&z->bz, 0, sizeof(z->bz));
+    ok = (BZ2_bzCompressInit(&z->bz, 9, 0, 0) == BZ_OK);
+    break;
+#endif
+#ifdef HAVE_LZMA
+  case OUT_LZMA: /* the .lzma format the lzma program writes */
+    z->xz = init;
+    ok = (lzma_lzma_preset(&opt, 9) == 0 && lzma_alone_encoder(&z->xz, &opt) == LZMA_OK);
+    break;
+  case OUT_XZ:
+    z->xz = init;
+    ok = (lzma_easy_encoder(&z->xz, 6, LZMA_CHECK_CRC64) == LZMA_OK);
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case OUT_ZSTD:
+    ok = ((z->zs = ZSTD_createCCtx()) != NULL && !ZSTD_isError(ZSTD_CCtx_setParameter(z->zs, ZSTD_c_compressionLevel, OUT_ZSTD_LEVEL)));
+    break;
+#endif
+#ifdef HAVE_LZ4
+  case OUT_LZ4:
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.compressionLevel = OUT_LZ4_LEVEL;
+    ok = (!LZ4F_isError(LZ4F_createCompressionContext(&z->lz, LZ4F_VERSION)) && !LZ4F_isError(n = LZ4F_compressBegin(z->lz, z->buf, OUT_Z_BYTES, &prefs)));
+    if (ok)
+      out_writev(z->buf, n, NULL, 0);
+    break;
+#endif
+  default:
+    break;
+  }
+  if (!ok) {
+    fprintf(stderr,"crunch: can't start compressing the output\n");
+    exit(EXIT_FAILURE);
+  }
+  z->open = 1;
+  z->blocks = z->nindex = 0;
+}
+
+/* -z: compress n bytes of s, or finish the stream, and write what comes out */
+static void out_zwrite(const char *s, size_t n, int finish) {
+struct outz *z = out.z;
+int ret = 0, bad = 0;
+#ifdef HAVE_ZSTD
+ZSTD_inBuffer ib;
+ZSTD_outBuffer ob;
+size_t left;
+#endif
+#ifdef HAVE_LZ4
+size_t piece, made;
+#endif
+
+  (void)s;
+  if (n == 0 && finish == 0)
+    return;
+
+  switch (z->algo) {
+#ifdef HAVE_ZLIB
+  case OUT_GZIP:
+    z->gz.next_in = (Bytef *)s;
+    z->gz.avail_in = (uInt)n;
+    do {
+      z->gz.next_out = (Bytef *)z->buf;
+      z->gz.avail_out = OUT_Z_BYTES;
+      ret = deflate(&z->gz, finish ? Z_FINISH : Z_NO_FLUSH);
+      out_writev(z->buf, OUT_Z_BYTES - z->gz.avail_out, NULL, 0);
+    } while (ret == Z_OK && (z->gz.avail_out == 0 || finish));
+    bad = (ret == Z_STREAM_ERROR);
+    break;
+#endif
+#ifdef HAVE_BZLIB
+  case OUT_BZIP2:
+    z->bz.next_in = (char *)s;
+    z->bz.avail_in = (unsigned)n;
+    do {
+      z->bz.next_out = z->buf;
+      z->bz.avail_out = OUT_Z_BYTES;
+      ret = BZ2_bzCompress(&z->bz, finish ? BZ_FINISH : BZ_RUN);
+      out_writev(z->buf, OUT_Z_BYTES - z->bz.avail_out, NULL, 0);
+    } while ((ret == BZ_RUN_OK && z->bz.avail_in > 0) || ret == BZ_FINISH_OK);
+    bad = (ret < 0);
+    break;
+#endif
+#ifdef HAVE_LZMA
+  case OUT_LZMA:
+  case OUT_XZ:
+    z->xz.next_in = (const uint8_t *)s;
+    z->xz.avail_in = n;
+    do {
+      z->xz.next_out = (uint8_t *)z->buf;
+      z->xz.avail_out = OUT_Z_BYTES;
+      ret = (int)lzma_code(&z->xz, finish ? LZMA_FINISH : LZMA_RUN);
+      out_writev(z->buf, OUT_Z_BYTES - z->xz.avail_out, NULL, 0);
+    } while (ret == LZMA_OK && (z->xz.avail_in > 0 || z->xz.avail_out == 0 || finish));
+    bad = (ret != LZMA_OK && ret != LZMA_STREAM_END);
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case OUT_ZSTD:
+    ib.src = s;
+    ib.size = n;
+    ib.pos = 0;
+    do {
+      ob.dst = z->buf;
+      ob.size = OUT_Z_BYTES;
+      ob.pos = 0;
+      left = ZSTD_compressStream2(z->zs, &ob, &ib, finish ? ZSTD_e_end : ZSTD_e_continue);
+      if ((bad = ZSTD_isError(left)) != 0)
+        break;
+      out_writev(z->buf, ob.pos, NULL, 0);
+    } while (finish ? left != 0 : ib.pos < ib.size);
+    break;
+#endif
+#ifdef HAVE_LZ4
+  case OUT_LZ4: /* in pieces whose output always fits in buf */
+    while (n > 0 && !bad) {
+      piece = (n < OUT_Z_BYTES/4) ? n : OUT_Z_BYTES/4;
+      made = LZ4F_compressUpdate(z->lz, z->buf, OUT_Z_BYTES, s, piece, NULL);
+      if ((bad = LZ4F_isError(made)) == 0)
+        out_writev(z->buf, made, NULL, 0);
+      s += piece;
+      n -= piece;
+    }
+    if (finish && !bad) {
+      made = LZ4F_compressEnd(z->lz, z->buf, OUT_Z_BYTES, NULL);
+      if ((bad = LZ4F_isError(made)) == 0)
+        out_writev(z->buf, made, NULL, 0);
+    }
+    break;
+#endif
+  default:
+    break;
+  }
+  if (bad) {
+    fprintf(stderr,"crunch: compression failed = %d\n", ret);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* -z: finish the stream in fpath and let go of the compressor.  renamefile
+   calls this before it renames the file */
+static void out_zfinish(const char *fpath) {
+struct outz *z = out.z;
+
+  if (z->open == 0)
+    return;
+  if (out_open(fpath, 1, 0) != 0) {
+    fprintf(stderr,"crunch: can't reopen %s to finish compressing it\n", fpath);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (z->pool != NULL) { /* every block is complete, but there must be one */
+    if (z->blocks == 0)
+      out_zsubmit();
+    if (z->indexed && z->algo == OUT_ZSTD) {
+      out_zdrain();
+      out_zseektable();
+    }
+  }
+  else
+    out_zwrite(NULL, 0, 1);
+
+  switch (z->pool != NULL ? 0 : z->algo) {
+#ifdef HAVE_ZLIB
+  case OUT_GZIP:
+    (void)deflateEnd(&z->gz);
+    break;
+#endif
+#ifdef HAVE_BZLIB
+  case OUT_BZIP2:
+    (void)BZ2_bzCompressEnd(&z->bz);
+    break;
+#endif
+#ifdef HAVE_LZMA
+  case OUT_LZMA:
+  case OUT_XZ:
+    lzma_end(&z->xz);
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case OUT_ZSTD:
+    (void)ZSTD_freeCCtx(z->zs);
+    break;
+#endif
+#ifdef HAVE_LZ4
+  case OUT_LZ4:
+    (void)LZ4F_freeCompressionContext(z->lz);
+    break;
+#endif
+  default:
+    break;
+  }
+  z->open = 0;
+
+  if (out_close() != 0) {
+    fprintf(stderr,"crunch: close returned error number = %d\n", errno);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* -r with -z: up to n bytes decoded from START.  0 once there is no more,
+   at the end of the stream or where a file cut short stops */
+static size_t out_zread(struct zin *in, char *buf, size_t n) {
+size_t made = 0;
+ssize_t got;
+#ifdef HAVE_BZLIB
+int bzerr, nunused;
+void *unused;
+#endif
+#ifdef HAVE_LZMA
+lzma_ret ret;
+#endif
+#ifdef HAVE_ZSTD
+ZSTD_inBuffer ib;
+ZSTD_outBuffer ob;
+size_t r;
+#endif
+#ifdef HAVE_LZ4
+size_t dst, src, hint;
+#endif
+
+  (void)buf;
+  (void)n;
+  if (in->end)
+    return 0;
+
+#ifdef HAVE_ZLIB
+  if (in->algo == OUT_GZIP) {
+    if ((got = gzread(in->gz, buf, (unsigned)n)) <= 0)
+      in->end = 1;
+    return (got > 0) ? (size_t)got : 0;
+  }
+#endif
+#ifdef HAVE_BZLIB
+  if (in->algo == OUT_BZIP2) {
+    got = BZ2_bzRead(&bzerr, in->bz, buf, (int)n);
+    if (bzerr == BZ_STREAM_END) { /* --zjobs writes a stream per block */
+      BZ2_bzReadGetUnused(&bzerr, in->bz, &unused, &nunused);
+      memcpy(in->buf, unused, (size_t)nunused);
+      BZ2_bzReadClose(&bzerr, in->bz);
+      if ((in->bz = BZ2_bzReadOpen(&bzerr, in->fp, 0, 0, in->buf, nunused)) == NULL)
+        in->end = 1;
+    }
+    else if (bzerr != BZ_OK)
+      in->end = 1;
+    return (got > 0) ? (size_t)got : 0;
+  }
+#endif
+
+  /* the rest are fed from in->buf */
+  while (made == 0 && in->end == 0) {
+    if (in->pos == in->len) {
+      if ((got = read(in->fd, in->buf, OUT_Z_BYTES)) <= 0) {
+        in->end = 1;
+        break;
+      }
+      in->len = (size_t)got;
+      in->pos = 0;
+    }
+    switch (in->algo) {
+#ifdef HAVE_LZMA
+    case OUT_LZMA:
+    case OUT_XZ:
+      in->xz.next_in = (const uint8_t *)&in->buf[in->pos];
+      in->xz.avail_in = in->len - in->pos;
+      in->xz.next_out = (uint8_t *)buf;
+      in->xz.avail_out = n;
+      ret = lzma_code(&in->xz, LZMA_RUN);
+      in->pos = in->len - in->xz.avail_in;
+      made = n - in->xz.avail_out;
+      if (ret != LZMA_OK)
+        in->end = 1;
+      break;
+#endif
+#ifdef HAVE_ZSTD
+    case OUT_ZSTD:
+      ib.src = in->buf;
+      ib.size = in->len;
+      ib.pos = in->pos;
+      ob.dst = buf;
+      ob.size = n;
+      ob.pos = 0;
+      r = ZSTD_decompressStream(in->zs, &ob, &ib);
+      in->pos = ib.pos;
+      made = ob.pos;
+      if (ZSTD_isError(r))
+        in->end = 1;
+      break;
+#endif
+#ifdef HAVE_LZ4
+    case OUT_LZ4:
+      dst = n;
+      src = in->len - in->pos;
+      hint = LZ4F_decompress(in->lz, buf, &dst, &in->buf[in->pos], &src, NULL);
+      in->pos += src;
+      made = dst;
+      if (LZ4F_isError(hint)) /* 0 ends a frame, another may follow */
+        in->end = 1;
+      break;
+#endif
+    default:
+      in->end = 1;
+      break;
+    }
+  }
+  return made;
+}
+
+/*
+  -r with -z.  START holds a stream that was never finished.  Decode what
+  is there up to the last whole line and write it into a new stream, which
+  stays open for the words still to come.  Counts lines and bytes like
+  resumesession does and leaves the last line in line
+*/
+static void out_zresume(const char *fpath, char *line, size_t size) {
+struct zin in;
+char *tmp, *buf;
+size_t len = 0, keep, i, n;
+int ok = 0;
+#ifdef HAVE_BZLIB
+int bzerr;
+#endif
+#ifdef HAVE_LZMA
+lzma_stream init = LZMA_STREAM_INIT;
+#endif
+
+  memset(&in, 0, sizeof(in));
+  in.algo = out.z->algo;
+  tmp = calloc(strlen(fpath)+5, sizeof(char));
+  buf = malloc(OUT_Z_BYTES);
+  in.buf = malloc(OUT_Z_BYTES);
+  if (tmp == NULL || buf == NULL || in.buf == NULL) {
+    fprintf(stderr,"resume: can't allocate memory to decompress START\n");
+    exit(EXIT_FAILURE);
+  }
+  strcat(strcpy(tmp, fpath), ".tmp");
+
+  if ((in.fd = open(fpath, O_RDONLY)) < 0) {
+    fprintf(stderr,"resume: File START could not be opened\n");
+    exit(EXIT_FAILURE);
+  }
+  switch (in.algo) {
+#ifdef HAVE_ZLIB
+  case OUT_GZIP:
+    ok = ((in.gz = gzdopen(in.fd, "rb")) != NULL);
+    break;
+#endif
+#ifdef HAVE_BZLIB
+  case OUT_BZIP2:
+    ok = ((in.fp = fdopen(in.fd, "rb")) != NULL && (in.bz = BZ2_bzReadOpen(&bzerr, in.fp, 0, 0, NULL, 0)) != NULL);
+    break;
+#endif
+#ifdef HAVE_LZMA
+  case OUT_LZMA:
+    in.xz = init;
+    ok = (lzma_alone_decoder(&in.xz, UINT64_MAX) == LZMA_OK);
+    break;
+  case OUT_XZ:
+    in.xz = init;
+    ok = (lzma_stream_decoder(&in.xz, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK);
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case OUT_ZSTD:
+    ok = ((in.zs = ZSTD_createDCtx()) != NULL);
+    break;
+#endif
+#ifdef HAVE_LZ4
+  case OUT_LZ4:
+    ok = !LZ4F_isError(LZ4F_createDecompressionContext(&in.lz, LZ4F_VERSION));
+    break;
+#endif
+  default:
+    break;
+  }
+  if (!ok) {
+    fprintf(stderr,"resume: START can't be decompressed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (out_open(tmp, 0, 0) != 0) {
+    fprintf(stderr,"resume: %s could not be opened\n", tmp);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  line[0] = '\0';
+  while ((n = out_zread(&in, &buf[len], OUT_Z_BYTES - len)) > 0) {
+    len += n;
+    for (keep = len; keep > 0 && buf[keep-1] != '\n'; keep--)
+      ;
+    if (keep == 0)
+      continue;
+
+    for (i = 0; i < keep; i++)
+      if (buf[i] == '\n')
+        my_thread.linecounter++;
+    my_thread.bytecounter += (unsigned long long)keep;
+    for (i = keep-1; i > 0 && buf[i-1] != '\n'; i--)
+      ;
+    n = (keep-i < size) ? keep-i : size-1;
+    memcpy(line, &buf[i], n);
+    line[n] = '\0';
+
+    out_write(buf, keep);
+    len -= keep;
+    memmove(buf, &buf[keep], len);
+  }
+
+  switch (in.algo) {
+#ifdef HAVE_ZLIB
+  case OUT_GZIP:
+    (void)gzclose(in.gz);
+    in.fd = -1;
+    break;
+#endif
+#ifdef HAVE_BZLIB
+  case OUT_BZIP2:
+    if (in.bz != NULL)
+      BZ2_bzReadClose(&bzerr, in.bz);
+    (void)fclose(in.fp);
+    in.fd = -1;
+    break;
+#endif
+#ifdef HAVE_LZMA
+  case OUT_LZMA:
+  case OUT_XZ:
+    lzma_end(&in.xz);
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case OUT_ZSTD:
+    (void)ZSTD_freeDCtx(in.zs);
+    break;
+#endif
+#ifdef HAVE_LZ4
+  case OUT_LZ4:
+    (void)LZ4F_freeDecompressionContext(in.lz);
+    break;
+#endif
+  default:
+    break;
+  }
+  if (in.fd >= 0)
+    (void)close(in.fd);
+
+  if (out_close() != 0 || rename(tmp, fpath) != 0) {
+    fprintf(stderr,"resume: can't replace START = %d\n", errno);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  free(in.buf);
+  free(buf);
+  free(tmp);
+}
+
+/* the output buffer is one of several that get handed off, so it can't grow */
+static int out_fixed(void) {
+  return (out.pages != NULL || out.map || out.ring != NULL || out.direct || (out.z != NULL && out.z->pool != NULL));
+}
+
+/* --zjobs: start that many compressors.  Every full buffer becomes a block,
+   so buffers get the --uring floor, and twice as many are in the air as
+   there are threads to keep them all busy */
+static void out_zpool(size_t threads) {
+struct zpool *p;
+char *grown;
+size_t k;
+
+  if (out.size < OUT_MIN_SPLICE) {
+    if ((grown = realloc(out.buf, OUT_MIN_SPLICE + SWEEP_SLACK)) == NULL) {
+      fprintf(stderr,"crunch: can't allocate memory for the output buffer\n");
+      exit(EXIT_FAILURE);
+    }
+    out.buf = grown;
+    out.size = OUT_MIN_SPLICE;
+  }
+
+  p = calloc(1, sizeof(struct zpool));
+  if (p != NULL) {
+    p->nslots = 2*threads;
+    p->slots = calloc(p->nslots, sizeof(struct zblock));
+    p->threads = calloc(threads, sizeof(pthread_t));
+  }
+  if (p == NULL || p->slots == NULL || p->threads == NULL) {
+    fprintf(stderr,"crunch: can't allocate memory for the output buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  for (k = 0; k < p->nslots; k++)
+    if ((p->slots[k].in = malloc(out.size + SWEEP_SLACK)) == NULL) {
+      fprintf(stderr,"crunch: can't allocate memory for the output buffer\n");
+      exit(EXIT_FAILURE);
+    }
+  p->algo = out.z->algo;
+  (void)pthread_mutex_init(&p->lock, NULL);
+  (void)pthread_cond_init(&p->changed, NULL);
+
+  for (k = 0; k < threads; k++) {
+    if (pthread_create(&p->threads[k], NULL, zpool_worker, p) != 0) {
+      fprintf(stderr,"out_zpool: pthread_create failed\n");
+      exit(EXIT_FAILURE);
+    }
+    p->nthreads++;
+  }
+  out.z->pool = p;
+}
+
+static void *zpool_worker(void *arg) {
+struct zpool *p = (struct zpool *)arg;
+struct zblock *b;
+const char *c;
+
+  (void)pthread_mutex_lock(&p->lock);
+  for (;;) {
+    if (p->taken == p->next) {
+      if (p->quit)
+        break;
+      (void)pthread_cond_wait(&p->changed, &p->lock);
+      continue;
+    }
+    b = &p->slots[p->taken++ % p->nslots];
+    b->state = 2;
+    (void)pthread_mutex_unlock(&p->lock);
+
+    for (b->words = 0, c = b->in; (c = memchr(c, '\n', (size_t)(b->in + b->inlen - c))) != NULL; c++)
+      b->words++; /* cheap next to compressing it */
+    out_zblock(p->algo, b);
+
+    (void)pthread_mutex_lock(&p->lock);
+    b->state = 3;
+    (void)pthread_cond_broadcast(&p->changed);
+  }
+  (void)pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/* compress b->in into a complete stream of its own in b->out.  Levels are
+   the ones out_zstart uses */
+static void out_zblock(int algo, struct zblock *b) {
+size_t bound = b->inlen + b->inlen/8 + 65536; /* more than any of them need */
+char *grown;
+int bad = 1;
+#ifdef HAVE_ZLIB
+z_stream gz;
+#endif
+#ifdef HAVE_BZLIB
+unsigned int bzlen;
+#endif
+#ifdef HAVE_LZMA
+size_t pos = 0;
+#endif
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+size_t made;
+#endif
+#ifdef HAVE_LZ4
+LZ4F_preferences_t prefs;
+#endif
+
+  if (b->outsize < bound) {
+    if ((grown = realloc(b->out, bound)) == NULL) {
+      fprintf(stderr,"crunch: can't allocate memory for the output buffer\n");
+      exit(EXIT_FAILURE);
+    }
+    b->out = grown;
+    b->outsize = bound;
+  }
+
+  switch (algo) {
+#ifdef HAVE_ZLIB
+  case OUT_GZIP: /* a gzip member per block, like pigz */
+    memset(&gz, 0, sizeof(gz));
+    if (deflateInit2(&gz, 9, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      break;
+    gz.next_in = (Bytef *)b->in;
+    gz.avail_in = (uInt)b->inlen;
+    gz.next_out = (Bytef *)b->out;
+    gz.avail_out = (uInt)b->outsize;
+    bad = (deflate(&gz, Z_FINISH) != Z_STREAM_END);
+    b->outlen = b->outsize - gz.avail_out;
+    (void)deflateEnd(&gz);
+    break;
+#endif
+#ifdef HAVE_BZLIB
+  case OUT_BZIP2:
+    bzlen = (unsigned int)b->outsize;
+    bad = (BZ2_bzBuffToBuffCompress(b->out, &bzlen, b->in, (unsigned int)b->inlen, 9, 0, 0) != BZ_OK);
+    b->outlen = bzlen;
+    break;
+#endif
+#ifdef HAVE_LZMA
+  case OUT_XZ:
+    bad = (lzma_easy_buffer_encode(6, LZMA_CHECK_CRC64, NULL, (const uint8_t *)b->in, b->inlen, (uint8_t *)b->out, &pos, b->outsize) != LZMA_OK);
+    b->outlen = pos;
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case OUT_ZSTD:
+    made = ZSTD_compress(b->out, b->outsize, b->in, b->inlen, OUT_ZSTD_LEVEL);
+    if ((bad = ZSTD_isError(made)) == 0)
+      b->outlen = made;
+    break;
+#endif
+#ifdef HAVE_LZ4
+  case OUT_LZ4:
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.compressionLevel = OUT_LZ4_LEVEL;
+    made = LZ4F_compressFrame(b->out, b->outsize, b->in, b->inlen, &prefs);
+    if ((bad = LZ4F_isError(made)) == 0)
+      b->outlen = made;
+    break;
+#endif
+  default:
+    break;
+  }
+  if (bad) {
+    fprintf(stderr,"crunch: compression failed\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* --zjobs: hand out.buf to the pool and carry on with a free buffer.  Waits
+   for one if the writes are behind */
+static void out_zsubmit(void) {
+struct zpool *p = out.z->pool;
+struct zblock *b;
+char *swap;
+
+  (void)pthread_mutex_lock(&p->lock);
+  b = &p->slots[p->next % p->nslots];
+  while (b->state != 0)
+    if (zpool_write(p) == 0)
+      (void)pthread_cond_wait(&p->changed, &p->lock);
+  swap = b->in;
+  b->in = out.buf;
+  b->inlen = out.len;
+  b->state = 1;
+  out.buf = swap;
+  p->next++;
+  out.z->blocks++;
+  (void)pthread_cond_broadcast(&p->changed);
+  (void)zpool_write(p);
+  (void)pthread_mutex_unlock(&p->lock);
+  out.len = 0;
+}
+
+/* write the blocks that are done, in order.  Called with the lock held,
+   which is let go of around the writes.  Only the main thread writes */
+static int zpool_write(struct zpool *p) {
+struct outz *z = out.z;
+struct zblock *b;
+struct zentry *e;
+int n = 0;
+
+  while (p->written < p->next && (b = &p->slots[p->written % p->nslots])->state == 3) {
+    (void)pthread_mutex_unlock(&p->lock);
+    out_writev(b->out, b->outlen, NULL, 0);
+    if (z->indexed) {
+      if (z->nindex == z->maxindex) {
+        z->maxindex = (z->maxindex == 0) ? 64 : 2*z->maxindex;
+        if ((e = realloc(z->index, z->maxindex*sizeof(struct zentry))) == NULL) {
+          fprintf(stderr,"crunch: can't allocate memory for the --zindex table\n");
+          exit(EXIT_FAILURE);
+        }
+        z->index = e;
+      }
+      e = &z->index[z->nindex];
+      e->word = (z->nindex == 0) ? 0 : e[-1].word + e[-1].words;
+      e->off = (z->nindex == 0) ? 0 : e[-1].off + e[-1].size;
+      e->words = b->words;
+      e->size = b->outlen;
+      e->bytes = b->inlen;
+      z->nindex++;
+    }
+    (void)pthread_mutex_lock(&p->lock);
+    b->state = 0;
+    p->written++;
+    n++;
+  }
+  return n;
+}
+
+/* --zjobs: everything handed to the pool is in the file */
+static void out_zdrain(void) {
+struct zpool *p = out.z->pool;
+
+  (void)pthread_mutex_lock(&p->lock);
+  while (p->written < p->next)
+    if (zpool_write(p) == 0)
+      (void)pthread_cond_wait(&p->changed, &p->lock);
+  (void)pthread_mutex_unlock(&p->lock);
+}
+
+/* --zindex: write the block table of the file renamefile just finished to
+   fpath.idx, a line per block.  Any block can be cut out of the file with
+   its offset and size and decompressed on its own */
+static void out_zindex(const char *fpath) {
+struct outz *z = out.z;
+char *name;
+FILE *fp;
+size_t k;
+
+  if ((name = malloc(strlen(fpath) + 5)) == NULL) {
+    fprintf(stderr,"crunch: can't allocate memory for the --zindex name\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(name, fpath);
+  strcat(name, ".idx");
+  if ((fp = fopen(name, "w")) == NULL) {
+    fprintf(stderr,"crunch: can't create %s\n", name);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fprintf(fp, "# first word, words, offset, compressed bytes, bytes\n");
+  for (k = 0; k < z->nindex; k++)
+    fprintf(fp, "%llu %llu %llu %llu %llu\n", z->index[k].word, z->index[k].words, z->index[k].off, z->index[k].size, z->index[k].bytes);
+  if (fclose(fp) != 0) {
+    fprintf(stderr,"crunch: can't write %s\n", name);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  z->nindex = 0;
+  free(name);
+}
+
+/* --zindex with zstd: also end the file with the seek table of the zstd
+   seekable format, in a skippable frame plain zstd passes over.  Little
+   endian: frame sizes, then frame count, a descriptor and the magic */
+static void out_zseektable(void) {
+struct outz *z = out.z;
+unsigned char *t;
+size_t k, j, n = 8 + 8*z->nindex + 9;
+unsigned long v[3];
+
+  if ((t = malloc(n)) == NULL) {
+    fprintf(stderr,"crunch: can't allocate memory for the --zindex table\n");
+    exit(EXIT_FAILURE);
+  }
+  v[0] = ZSTD_SKIP_MAGIC;
+  v[1] = (unsigned long)(n - 8);
+  for (j = 0; j < 8; j++)
+    t[j] = (unsigned char)(v[j/4] >> 8*(j%4));
+  for (k = 0; k < z->nindex; k++) {
+    v[0] = (unsigned long)z->index[k].size;
+    v[1] = (unsigned long)z->index[k].bytes;
+    for (j = 0; j < 8; j++)
+      t[8 + 8*k + j] = (unsigned char)(v[j/4] >> 8*(j%4));
+  }
+  v[0] = (unsigned long)z->nindex;
+  v[1] = ZSTD_SEEK_MAGIC;
+  for (j = 0; j < 4; j++) {
+    t[n-9+j] = (unsigned char)(v[0] >> 8*j);
+    t[n-4+j] = (unsigned char)(v[1] >> 8*j);
+  }
+  t[n-5] = 0; /* no checksums */
+  out_writev((char *)t, n, NULL, 0);
+  free(t);
+}
+
+/*
+  --mmap: map the OUT_MAP_BYTES of the file around offset off and point buf
+  at off.  Blocks are allocated before they are mapped, so a full disk is an
+  error here rather than a SIGBUS in the middle of a word.  The file is
+  longer than what was written until out_close cuts it back
+*/
+static void out_map_at(unsigned long long off) {
+unsigned long long page = (unsigned long long)sysconf(_SC_PAGESIZE);
+unsigned long long base = off / page * page;
+int err;
+
+  if (base + OUT_MAP_BYTES > out.reserved) {
+    if ((err = posix_fallocate(out.fd, (off_t)base, OUT_MAP_BYTES)) != 0) {
+      fprintf(stderr,"crunch: can't allocate space in the output file = %d\n", err);
+      fprintf(stderr,"The problem is = %s\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+    out.reserved = base + OUT_MAP_BYTES;
+  }
+
+  out.win = mmap(NULL, OUT_MAP_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, out.fd, (off_t)base);
+  if (out.win == MAP_FAILED) {
+    fprintf(stderr,"crunch: mmap failed = %d\n", errno);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  out.pos = off;
+  out.buf = &out.win[off - base];
+  out.size = OUT_MAP_BYTES - (size_t)(off - base) - SWEEP_SLACK;
+  out.len = 0;
+}
+
+/* --mmap: drop the window.  Returns the file offset the next byte goes to */
+static unsigned long long out_unmap(void) {
+unsigned long long end = out.pos + out.len;
+
+  out_sum(&out.buf[out.seen], out.len - out.seen); /* out_close doesn't flush */
+  out_ends(&out.buf[out.seen], out.len - out.seen);
+  (void)munmap(out.win, OUT_MAP_BYTES);
+  out.win = out.buf = NULL;
+  out.size = out.len = out.seen = 0;
+  return end;
+}
+
+#ifdef HAVE_URING
+static int uring_enter(unsigned submit, unsigned wait) {
+int ret;
+
+  do {
+    ret = (int)syscall(__NR_io_uring_enter, out.ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+/* whether the kernel takes IORING_OP_WRITE, which came after io_uring
+   itself in 5.6.  Kernels without IORING_REGISTER_PROBE don't */
+static int uring_can_write(int fd) {
+#ifdef IO_URING_OP_SUPPORTED
+struct io_uring_probe *probe;
+int ok;
+
+  if ((probe = calloc(1, sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op))) == NULL) {
+    fprintf(stderr,"crunch: can't allocate memory for io_uring\n");
+    exit(EXIT_FAILURE);
+  }
+  ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 && probe->last_op >= IORING_OP_WRITE && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+#else
+  (void)fd;
+  return 0;
+#endif
+}
+
+/* unmap and close the ring, free r and its buffers */
+static void uring_drop(struct uring *r) {
+unsigned k;
+
+  for (k = 0; k < OUT_URING_BUFS; k++)
+    free(r->bufs[k]);
+  if (r->sqes != NULL && r->sqes != MAP_FAILED)
+    (void)munmap(r->sqes, r->sqes_len);
+  if (r->cq_ring != NULL && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+    (void)munmap(r->cq_ring, r->cq_len);
+  if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED)
+    (void)munmap(r->sq_ring, r->sq_len);
+  (void)close(r->fd);
+  free(r);
+}
+#endif
+
+/*
+  --uring.  Set up an io_uring and OUT_URING_BUFS buffers of the --buffer
+  size.  out_flush hands the full buffer to the ring as a write at its own
+  file offset and goes on filling the next free one, so words are made
+  while earlier ones are still on their way to the disk.  The buffers are
+  registered if the memlock limit allows, else plain writes are queued.
+  If the kernel has no io_uring, or can't do either, crunch stays with
+  write(2)
+*/
+static void out_uring(void) {
+#ifdef HAVE_URING
+struct io_uring_params p;
+struct uring *r;
+struct iovec iov[OUT_URING_BUFS];
+size_t size = out.size;
+unsigned k;
+int fd;
+
+  memset(&p, 0, sizeof(p));
+  if ((fd = (int)syscall(__NR_io_uring_setup, 2*OUT_URING_BUFS, &p)) < 0) {
+    fprintf(stderr,"crunch: io_uring is not available, using write instead\n");
+    return;
+  }
+  if ((r = calloc(1, sizeof(struct uring))) == NULL) {
+    fprintf(stderr,"crunch: can't allocate memory for io_uring\n");
+    exit(EXIT_FAILURE);
+  }
+  r->fd = fd;
+
+  r->sq_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_len > r->sq_len)
+    r->sq_len = r->cq_len;
+  r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ring = r->sq_ring;
+  else
+    r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  r->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+    fprintf(stderr,"crunch: can't map the io_uring, using write instead = %s\n", strerror(errno));
+    uring_drop(r);
+    return;
+  }
+  r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+  r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+  r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+  r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+  r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+  r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+  if (out.size < OUT_MIN_SPLICE) /* the buffers don't grow */
+    out.size = OUT_MIN_SPLICE;
+  for (k = 0; k < OUT_URING_BUFS; k++) {
+    if ((r->bufs[k] = malloc(out.size + SWEEP_SLACK)) == NULL) {
+      fprintf(stderr,"crunch: can't allocate memory for the output buffer\n");
+      exit(EXIT_FAILURE);
+    }
+    iov[k].iov_base = r->bufs[k];
+    iov[k].iov_len = out.size + SWEEP_SLACK;
+  }
+  r->fixed = (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, OUT_URING_BUFS) == 0);
+  if (r->fixed == 0 && !uring_can_write(fd)) {
+    fprintf(stderr,"crunch: io_uring can't take the buffers and has no plain write, using write instead\n");
+    uring_drop(r);
+    out.size = size;
+    return;
+  }
+
+  out_flush();
+  free(out.buf);
+  out.ring = r;
+  out.buf = r->bufs[0];
+#endif
+}
+
+#ifdef HAVE_URING
+/* queue the part of buffer k the kernel hasn't written yet */
+static void uring_submit(unsigned k) {
+struct uring *r = out.ring;
+struct io_uring_sqe *sqe;
+unsigned tail = *r->sq_tail;
+unsigned idx = tail & *r->sq_mask;
+
+  sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = out.fd;
+  sqe->off = r->at[k] + r->done[k];
+  sqe->addr = (unsigned long)(r->bufs[k] + r->done[k]);
+  sqe->len = (unsigned)(r->len[k] - r->done[k]);
+  sqe->buf_index = (unsigned short)k;
+  sqe->user_data = k;
+  r->sq_array[idx] = idx;
+  __atomic_store_n(r->sq_tail, tail+1, __ATOMIC_RELEASE);
+
+  if (uring_enter(1, 0) < 0) {
+    fprintf(stderr,"crunch: io_uring_enter failed = %d\n", errno);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* collect finished writes, waiting for one if wait is set.  Short writes
+   are sent again for the rest */
+static void uring_reap(int wait) {
+struct uring *r = out.ring;
+struct io_uring_cqe *cqe;
+unsigned head, k;
+int res;
+
+  if (wait && uring_enter(0, 1) < 0) {
+    fprintf(stderr,"crunch: io_uring_enter failed = %d\n", errno);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  head = *r->cq_head;
+  while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &r->cqes[head & *r->cq_mask];
+    k = (unsigned)cqe->user_data;
+    res = cqe->res;
+    __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+
+    if (res <= 0) {
+      fprintf(stderr,"crunch: write failed = %d\n", -res);
+      fprintf(stderr,"The problem is = %s\n", strerror(res < 0 ? -res : ENOSPC));
+      exit(EXIT_FAILURE);
+    }
+    r->done[k] += (size_t)res;
+    if (r->done[k] < r->len[k])
+      uring_submit(k);
+  }
+}
+
+/* hand out.buf to the kernel and move out.buf to a free buffer */
+static void uring_flush(void) {
+struct uring *r = out.ring;
+unsigned k = r->cur;
+
+  r->len[k] = out.len;
+  r->done[k] = 0;
+  r->at[k] = out.pos;
+  uring_submit(k);
+  out.pos += out.len;
+
+  r->cur = (k+1) % OUT_URING_BUFS;
+  uring_reap(0);
+  while (r->done[r->cur] < r->len[r->cur])
+    uring_reap(1);
+  out.buf = r->bufs[r->cur];
+  out.len = 0;
+}
+#endif
+
+static void out_free(void) {
+struct zpool *p;
+size_t t;
+
+#ifdef HAVE_URING
+  if (out.ring != NULL) {
+    uring_drop(out.ring);
+    out.ring = NULL;
+    out.buf = NULL;
+  }
+#endif
+  if (out.map == 0)
+    free(out.pages != NULL ? out.pages : out.buf);
+  out.pages = out.buf = NULL;
+  if (out.z != NULL) {
+    if ((p = out.z->pool) != NULL) {
+      (void)pthread_mutex_lock(&p->lock);
+      p->quit = 1;
+      (void)pthread_cond_broadcast(&p->changed);
+      (void)pthread_mutex_unlock(&p->lock);
+      for (t = 0; t < p->nthreads; t++)
+        (void)pthread_join(p->threads[t], NULL);
+      for (t = 0; t < p->nslots; t++) {
+        free(p->slots[t].in);
+        free(p->slots[t].out);
+      }
+      free(p->slots);
+      free(p->threads);
+      free(p);
+    }
+    free(out.z->index);
+    free(out.z->buf);
+    free(out.z);
+    out.z = NULL;
+  }
+}
+
+/* room for n more bytes, plus SWEEP_SLACK.  Fill it and call out_commit */
+static char *out_reserve(size_t n) {
+char *grown;
+
+  if (out.size - out.len < n) {
+    out_flush();
+    if (out.size < n && !out_fixed()) {
+      grown = realloc(out.buf, n + SWEEP_SLACK);
+      if (grown == NULL) {
+        fprintf(stderr,"crunch: can't allocate memory for the output buffer\n");
+        exit(EXIT_FAILURE);
+      }
+      out.buf = grown;
+      out.size = n;
+    }
+  }
+  return &out.buf[out.len];
+}
+
+static void out_commit(size_t n) {
+struct timespec now;
+
+  out.len += n;
+  if (out.flush_ms == 0 || ++out.ticks < OUT_TICKS)
+    return;
+
+  out.ticks = 0;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  if ((now.tv_sec - out.last.tv_sec)*1000L + (now.tv_nsec - out.last.tv_nsec)/1000000L >= out.flush_ms)
+    out_flush();
+}
+
+static void out_write(const char *s, size_t n) {
+size_t part;
+
+  if (n <= out.size - out.len) {
+    memcpy(&out.buf[out.len], s, n);
+    out_commit(n);
+  }
+  else if (out_fixed()) { /* fill them in pieces */
+    while (n > out.size - out.len) {
+      part = out.size - out.len;
+      memcpy(&out.buf[out.len], s, part);
+      out.len += part;
+      s += part;
+      n -= part;
+      out_flush();
+    }
+    memcpy(&out.buf[out.len], s, n);
+    out_commit(n);
+  }
+  else if (n < out.size/2 || out.z != NULL) {
+    memcpy(out_reserve(n), s, n);
+    out_commit(n);
+  }
+  else { /* big enough to skip the copy */
+    out_sum(&out.buf[out.seen], out.len - out.seen);
+    out_ends(&out.buf[out.seen], out.len - out.seen);
+    out_sum(s, n);
+    out_ends(s, n);
+    out_writev(out.buf, out.len, s, n);
+    out.len = out.seen = 0;
+    out_checkpoint();
+  }
+}
+
+/* point the output at fpath, appended to or truncated.  With --mmap expect
+   more bytes are allocated for it right away, so running out of space shows
+   up now.  -1 with errno set if it can't be opened */
+static int out_open(const char *fpath, int append, unsigned long long expect) {
+static int warned = 0; /* --direct on a filesystem without O_DIRECT */
+struct stat st;
+size_t tail;
+int flags;
+int err;
+
+  if (append == 0) { /* a new file, forget the last one's words */
+    out.headlen = out.taillen = 0;
+    out.filebytes = out.filewords = 0;
+    out.crc = 0;
+  }
+
+  if (out.direct) {
+    flags = O_RDWR | O_CREAT | (append ? 0 : O_TRUNC);
+    if ((out.fd = open(fpath, flags | O_DIRECT, 0666)) < 0 && errno == EINVAL) {
+      if (warned++ == 0)
+        fprintf(stderr,"crunch: %s can't be opened with O_DIRECT, writing through the page cache\n", fpath);
+      out.fd = open(fpath, flags, 0666);
+    }
+    if (out.fd < 0 || fstat(out.fd, &st) != 0)
+      return -1;
+    /* blocks are written whole, so an odd end is read back and written again */
+    tail = (size_t)(st.st_size % OUT_DIRECT_ALIGN);
+    if (tail > 0 && pread(out.fd, out.buf, OUT_DIRECT_ALIGN, st.st_size - (off_t)tail) != (ssize_t)tail)
+      return -1;
+    out.len = out.seen = tail;
+    return (lseek(out.fd, st.st_size - (off_t)tail, SEEK_SET) < 0) ? -1 : 0;
+  }
+
+  if (out.ring != NULL) { /* writes carry their own offsets */
+    if ((out.fd = open(fpath, O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC), 0666)) < 0)
+      return -1;
+    if (fstat(out.fd, &st) != 0)
+      return -1;
+    out.pos = (unsigned long long)st.st_size;
+    return 0;
+  }
+
+  if (out.map == 0) {
+    out.fd = open(fpath, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0666);
+    if (out.fd >= 0 && out.z != NULL && out.z->open == 0)
+      out_zstart();
+    return (out.fd < 0) ? -1 : 0;
+  }
+
+  if ((out.fd = open(fpath, O_RDWR | O_CREAT | (append ? 0 : O_TRUNC), 0666)) < 0)
+    return -1;
+  if (fstat(out.fd, &st) != 0)
+    return -1;
+  if (expect > 0 && (err = posix_fallocate(out.fd, st.st_size, (off_t)expect)) != 0) {
+    (void)close(out.fd);
+    out.fd = -1;
+    errno = err;
+    return -1;
+  }
+  out.reserved = (unsigned long long)st.st_size + expect;
+  out_map_at((unsigned long long)st.st_size);
+  return 0;
+}
+
+/* write out what is waiting and close the file out_open opened */
+static int out_close(void) {
+int ret;
+#ifdef HAVE_URING
+unsigned k;
+#endif
+
+  if (out.map && out.win != NULL && ftruncate(out.fd, (off_t)out_unmap()) != 0) {
+    (void)close(out.fd);
+    out.fd = -1;
+    return -1;
+  }
+  out_flush();
+  if (out.z != NULL && out.z->pool != NULL)
+    out_zdrain();
+  if (out.direct && out.len > 0) { /* the odd end can't go out with O_DIRECT */
+    (void)fcntl(out.fd, F_SETFL, fcntl(out.fd, F_GETFL) & ~O_DIRECT);
+    out_writev(out.buf, out.len, NULL, 0);
+    out.len = 0;
+  }
+#ifdef HAVE_URING
+  if (out.ring != NULL)
+    for (k = 0; k < OUT_URING_BUFS; k++)
+      while (out.ring->done[k] < out.ring->len[k])
+        uring_reap(1);
+#endif
+  ret = close(out.fd);
+  out.fd = -1;
+  return ret;
+}
+
+/* most bytes the output file chunk() is about to open can get: what is left
+   of the whole output, cut down by -b and -c.  0 if unknown */
+static unsigned long long file_bytes(size_t end) {
+unsigned long long n = 0;
+unsigned long long done = my_thread.bytetotal + my_thread.bytecounter;
+
+  if (my_thread.finalfilesize > done)
+    n = my_thread.finalfilesize - done;
+  if (bytecount > 0 && bytecount - my_thread.bytecounter < n)
+    n = bytecount - my_thread.bytecounter;
+  if (linecount > 0 && mul_sat(linecount - my_thread.linecounter, end*MB_CUR_MAX+1) < n)
+    n = (linecount - my_thread.linecounter)*(end*MB_CUR_MAX+1);
+  return n;
+}
+
+static unsigned long long fill_next_count(size_t si, size_t ei, int repeats, unsigned long long sum, /*@null@*/ unsigned long long *current_count, /*@out@*/ unsigned long long *next_count, size_t len) {
+size_t i;
+unsigned long long nextsum = 0;
+
+  for (i = 0; i < si; i++)
+    next_count[i] = 0;
+
+  if (repeats == 0 || current_count == NULL)
+    nextsum = sum;
+  else if (repeats == 1)
+    for (; i <= ei; i++) {
+      next_count[i] = sum - current_count[i];
+      nextsum += next_count[i];
+    }
+  else /* repeats > 1 */
+    for (; i <= ei; i++) {
+      next_count[i] = current_count[i];
+      nextsum += next_count[i];
+    }
+
+  for (; i < len; i++)
+    next_count[i] = 0;
+
+  return nextsum;
+}
+
+/* calculate the number of strings from start to end taking into account duplicate removal worst case: O(2^n), could be improved using memoize */
+static unsigned long long calculate_with_dupes(int start_point, int end_point, size_t first, size_t last, size_t pattern_index, int repeats, unsigned long long current_sum, /*@null@*/ unsigned long long *current_count, const options_type options, size_t plen) {
+/* start_point and end_point are bools */
+
+  unsigned long long count[MAXCSET];
+  unsigned long long *next_count;
+  unsigned long long total = 0, sum = 0;
+  size_t start_index, end_index;
+  size_t i;
+
+  if (first == NPOS || last == NPOS || first > last || pattern_index > plen) /* sanity check */
+    return 0;
+
+   /* check for too many duplicates */
+  if (pattern_index > 0 && (size_t)repeats > options.pattern_info[pattern_index-1].duplicates) {
+    return 0;
+  }
+
+  /* create the result count for pattern_index - 1 */
+  if (pattern_index == 0) {
+    sum = current_sum;
+    next_count = NULL;
+  }
+  else if (pattern_index == 1 ||
+      (options.pattern_info[pattern_index-1].cset != NULL &&
+      options.pattern_info[pattern_index-2].cset != options.pattern_info[pattern_index-1].cset) ||
+      (options.pattern_info[pattern_index-1].cset == NULL &&
+      options.pattern[pattern_index-2] != options.pattern[pattern_index-1])) {
+    /* beginning new cset */
+    if (repeats > 1) {
+      return 0;
+    }
+    if (options.pattern_info[pattern_index-1].cset != NULL) {
+      for (i = 0; i < first; i++)
+        count[i] = 0;
+      for (; i <= last; i++)
+        count[i] = current_sum;
+      for (; i < options.pattern_info[pattern_index-1].clen; i++)
+        count[i] = 0;
+      next_count = count;
+    } else
+      next_count = NULL;
+    sum = current_sum * (last - first + 1);
+  }
+  else if (options.pattern_info[pattern_index-1].cset == NULL &&
+      options.pattern[pattern_index-2] == options.pattern[pattern_index-1]) {
+    /* continuing unknown cset */
+    sum = current_sum;
+    next_count = NULL;
+  }
+  else {
+    /* continuing previous cset */
+    sum = fill_next_count(first, last, repeats, current_sum, current_count, count, options.pattern_info[pattern_index-1].clen);
+    next_count = count;
+  }
+
+  if (sum == 0) {
+    return 0;
+  }
+
+  if (pattern_index == plen) { /* check for the end of the pattern */
+    return sum;
+  }
+
+  if (options.pattern_info[pattern_index].is_fixed) {
+    start_index = end_index = options.pattern_info[pattern_index].start_index;
+  }
+  else {
+    start_index = 0;
+    end_index = options.pattern_info[pattern_index].clen - 1;
+    if (start_point)
+      start_index = options.pattern_info[pattern_index].start_index;
+    if (end_point)
+      end_index = options.pattern_info[pattern_index].end_index;
+  }
+
+  if (start_index == end_index) {
+    /* [0..si..0](sp, ep) */
+    if (repeats > 0)
+      total += calculate_with_dupes(start_point, end_point, start_index, end_index, pattern_index + 1, repeats + 1, sum, next_count, options, plen);
+    total += calculate_with_dupes(start_point, end_point, start_index, end_index, pattern_index + 1, 1, sum, next_count, options, plen);
+  }
+  else {
+    if (start_point) {
+      /* [0..si..0](sp, 0) */
+      if (repeats > 0)
+        total += calculate_with_dupes(start_point, 0, start_index, start_index, pattern_index + 1, repeats + 1, sum, next_count, options, plen);
+      total += calculate_with_dupes(start_point, 0, start_index, start_index, pattern_index + 1, 1, sum, next_count, options, plen);
+      start_index++;
+    }
+
+    if (end_point) {
+      /* [0..ei..0](0, ep) */
+      if (repeats > 0)
+        total += calculate_with_dupes(0, end_point, end_index, end_index, pattern_index + 1, repeats + 1, sum, next_count, options, plen);
+      total += calculate_with_dupes(0, end_point, end_index, end_index, pattern_index + 1, 1, sum, next_count, options, plen);
+      end_index--;
+    }
+
+    if (start_index <= end_index) {  /* middle */
+      /* [0..si..ei..0](0,0) */
+      if (repeats > 0)
+        total += calculate_with_dupes(0, 0, start_index, end_index, pattern_index + 1, repeats + 1, sum, next_count, options, plen);
+      total += calculate_with_dupes(0, 0, start_index, end_index, pattern_index + 1, 1, sum, next_count, options, plen);
+    }
+  }
+
+  return total;
+}
+
+/* calculate the number of strings from start to end O(n)  */
+static unsigned long long calculate_simple(const wchar_t *startstring, const wchar_t *endstring, const wchar_t *cset, size_t clen) {
+  unsigned long long total = 1;
+  size_t index1, index2;
+
+  for (; *endstring && *startstring; endstring++, startstring++) {
+    for (index1 = 0; cset[index1] != L'\0' && cset[index1] != *endstring;)
+      index1++;
+    if (cset[index1] == L'\0')
+      index1 -= 1;
+    for (index2 = 0; cset[index2] != L'\0' && cset[index2] != *startstring;)
+      index2++;
+    if (cset[index2] == L'\0')
+      index2 = 0;
+    total = (total - 1) * (unsigned long long)clen + (unsigned long long)index1 - (unsigned long long)index2 + 1;
+  }
+  return total;
+}
+
+/* calculate the number of strings from start to end, inclusive, taking into account the pattern O(n) */
+static unsigned long long calculate_with_pattern(const wchar_t *startstring, const wchar_t *endstring, const options_type options) {
+  unsigned long long total_strings = 1;
+  size_t temp, clen;
+  const wchar_t *cset;
+  size_t index1, index2;
+
+  if (options.pattern == NULL) {
+    return calculate_simple(startstring, endstring, options.low_charset, options.clen);
+  }
+
+  for (temp = 0; temp < options.plen; temp++) {
+    cset = NULL;
+    clen = 0;
+    switch (options.pattern[temp]) {
+      case L'@':
+        if (options.literalstring[temp] != L'@') {
+          clen = options.clen;
+          cset = options.low_charset;
         }
         break;
       case L',':
@@ -824,226 +2793,562 @@ int start_point = 0, end_point = 0; /* bool; whether to consider a starting or e
       }
       temp = calculate_with_dupes(0, end_point, first, last, 0, 0, 1, NULL, options, max);
     }
-    else {
-      if (endstring)
-        temp = calculate_simple(options.first_max, endstring, options.low_charset, options.clen);
-      else
-        temp = (unsigned long long)pow((double)options.clen, (double)max);
+    else {
+      if (endstring)
+        temp = calculate_simple(options.first_max, endstring, options.low_charset, options.clen);
+      else
+        temp = (unsigned long long)pow((double)options.clen, (double)max);
+    }
+
+    if ((linecount > 0) && (options.endstring==NULL)) {
+      *lines += linecount;
+      *bytes += linecount * (max + 1);
+    }
+    else {
+      *lines += temp;
+      *bytes += temp * (max + 1);
+    }
+
+    if (output_unicode!=0) {
+      if (suppress_finalsize==0 && check_dupes==0) {
+        extra_unicode_bytes = 0;
+        for (j = 0; j < max; j++) {
+          if (options.pattern_info[j].is_fixed!=0 || options.pattern_info[j].cset==NULL || options.pattern_info[j].clen==0)
+            extra_unicode_bytes += (getmblen(options.pattern[j])-1)*temp;
+          else
+            extra_unicode_bytes += (wcstombs(NULL,options.pattern_info[j].cset,0)-options.pattern_info[j].clen)*temp/options.pattern_info[j].clen;
+        }
+        *bytes += extra_unicode_bytes;
+      }
+      else
+        suppress_finalsize = 1;
+    }
+  }
+}
+
+static unsigned long long add_sat(unsigned long long a, unsigned long long b) {
+  return (a > ULLONG_MAX - b) ? ULLONG_MAX : a + b;
+}
+
+static unsigned long long mul_sat(unsigned long long a, unsigned long long b) {
+  return (b != 0 && a > ULLONG_MAX / b) ? ULLONG_MAX : a * b;
+}
+
+static size_t rank_char(const struct rankinfo *ri, wchar_t c) {
+size_t i;
+
+  for (i = 0; i < ri->nchars; i++)
+    if (ri->chars[i] == c)
+      return i;
+  return NPOS;
+}
+
+static unsigned long long *rank_ways(const struct rankinfo *ri, size_t k, size_t c, size_t r) {
+  return &ri->ways[(k*(ri->nchars+1) + c)*(ri->nruns+1) + r];
+}
+
+/* words left after putting chars[x] on the k-th position behind chars[c] seen r times */
+static unsigned long long rank_step(const struct rankinfo *ri, size_t k, size_t c, size_t r, size_t x) {
+  if (x != c || ri->limit[c] == NPOS)
+    return *rank_ways(ri, k+1, x, 1);
+  if (r+1 > ri->limit[c])
+    return 0;
+  return *rank_ways(ri, k+1, c, r+1);
+}
+
+static void fill_rankinfo(struct rankinfo *ri, size_t len, const options_type *options) {
+const struct pinfo *p;
+size_t k, pos, i, n, c, r, lim;
+size_t cid[MAXCSET]; /* rank_char() of each char of the current position */
+unsigned long long w;
+
+  ri->len = len;
+  n = 0;
+  for (pos = 0; pos < len; pos++)
+    n += options->pattern_info[pos].is_fixed ? 1 : options->pattern_info[pos].clen;
+
+  ri->chars = calloc(n+1, sizeof(wchar_t));
+  ri->limit = calloc(n+1, sizeof(size_t));
+  if (ri->chars == NULL || ri->limit == NULL) {
+    fprintf(stderr,"fill_rankinfo: can't allocate memory for chars\n");
+    exit(EXIT_FAILURE);
+  }
+
+  ri->nchars = 0;
+  for (pos = 0; pos < len; pos++) {
+    p = &options->pattern_info[pos];
+    for (i = 0; i < (p->is_fixed ? 1 : p->clen); i++)
+      if (rank_char(ri, p->is_fixed ? options->pattern[pos] : p->cset[i]) == NPOS)
+        ri->chars[ri->nchars++] = p->is_fixed ? options->pattern[pos] : p->cset[i];
+  }
+
+  ri->nruns = 1;
+  for (c = 0; c < ri->nchars; c++) {
+    lim = char_dupe_limit(ri->chars[c], options);
+    ri->limit[c] = (lim >= len) ? NPOS : lim;
+    if (lim < len && lim > ri->nruns)
+      ri->nruns = lim;
+  }
+  ri->limit[ri->nchars] = NPOS;
+
+  ri->ways = calloc((len+1)*(ri->nchars+1)*(ri->nruns+1), sizeof(unsigned long long));
+  if (ri->ways == NULL) {
+    fprintf(stderr,"fill_rankinfo: can't allocate memory for ways\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (c = 0; c <= ri->nchars; c++)
+    for (r = 0; r <= ri->nruns; r++)
+      *rank_ways(ri, len, c, r) = 1;
+
+  for (k = len; k-- > 0;) {
+    pos = inverted ? len-1-k : k;
+    p = &options->pattern_info[pos];
+    n = p->is_fixed ? 1 : p->clen;
+    for (i = 0; i < n; i++)
+      cid[i] = rank_char(ri, p->is_fixed ? options->pattern[pos] : p->cset[i]);
+
+    for (c = 0; c <= ri->nchars; c++)
+      for (r = 0; r <= ri->nruns; r++) {
+        w = 0;
+        for (i = 0; i < n; i++)
+          w = add_sat(w, rank_step(ri, k, c, r, cid[i]));
+        *rank_ways(ri, k, c, r) = w;
+      }
+  }
+}
+
+static void free_rankinfo(struct rankinfo *ri) {
+  free(ri->chars);
+  free(ri->limit);
+  free(ri->ways);
+}
+
+/* number of words of length len chunk() makes without -s and -e.
+   Saturates at ULLONG_MAX */
+static unsigned long long count_words(size_t len, const options_type *options) {
+struct rankinfo ri;
+unsigned long long total = 1;
+size_t pos;
+
+  if (options->plan->check_dupes) {
+    fill_rankinfo(&ri, len, options);
+    total = *rank_ways(&ri, 0, ri.nchars, 0);
+    free_rankinfo(&ri);
+    return total;
+  }
+
+  for (pos = 0; pos < len; pos++)
+    if (!options->pattern_info[pos].is_fixed)
+      total = mul_sat(total, options->pattern_info[pos].clen);
+  return total;
+}
+
+/* index of block among the words of length len, counted the way chunk()
+   hands them out.  Words -d rejects get the index of the next word it
+   accepts */
+static unsigned long long rank_word(const wchar_t *block, size_t len, const options_type *options) {
+const struct pinfo *p;
+struct rankinfo ri;
+unsigned long long total = 0;
+size_t k, pos, i, x, c, r;
+
+  if (options->plan->check_dupes == 0) {
+    for (k = 0; k < len; k++) {
+      pos = inverted ? len-1-k : k;
+      p = &options->pattern_info[pos];
+      if (p->is_fixed)
+        continue;
+      if ((i = symtab_index(p->syms, block[pos])) == NPOS)
+        i = 0;
+      total = add_sat(mul_sat(total, p->clen), i);
+    }
+    return total;
+  }
+
+  fill_rankinfo(&ri, len, options);
+  c = ri.nchars;
+  r = 0;
+  for (k = 0; k < len; k++) {
+    pos = inverted ? len-1-k : k;
+    p = &options->pattern_info[pos];
+    if (!p->is_fixed)
+      for (i = 0; i < p->clen && p->cset[i] != block[pos]; i++)
+        total = add_sat(total, rank_step(&ri, k, c, r, rank_char(&ri, p->cset[i])));
+
+    x = rank_char(&ri, block[pos]);
+    if (x == NPOS || rank_step(&ri, k, c, r, x) == 0)
+      break; /* nothing -d accepts starts with this prefix */
+    r = (x == c && ri.limit[c] != NPOS) ? r+1 : 1;
+    c = x;
+  }
+  free_rankinfo(&ri);
+  return total;
+}
+
+/* load block with the word of length len at index, the reverse of rank_word() */
+static void unrank_word(wchar_t *block, size_t len, unsigned long long index, const options_type *options) {
+const struct pinfo *p;
+struct rankinfo ri;
+unsigned long long n;
+size_t k, pos, i, x = 0, c, r;
+
+  block[len] = L'\0';
+
+  if (options->plan->check_dupes == 0) {
+    for (k = len; k-- > 0;) {
+      pos = inverted ? len-1-k : k;
+      p = &options->pattern_info[pos];
+      if (p->is_fixed) {
+        block[pos] = options->pattern[pos];
+        continue;
+      }
+      block[pos] = p->cset[index % p->clen];
+      index /= p->clen;
     }
+    return;
+  }
 
-    if ((linecount > 0) && (options.endstring==NULL)) {
-      *lines += linecount;
-      *bytes += linecount * (max + 1);
+  fill_rankinfo(&ri, len, options);
+  c = ri.nchars;
+  r = 0;
+  for (k = 0; k < len; k++) {
+    pos = inverted ? len-1-k : k;
+    p = &options->pattern_info[pos];
+    if (p->is_fixed) {
+      block[pos] = options->pattern[pos];
+      x = rank_char(&ri, block[pos]);
     }
     else {
-      *lines += temp;
-      *bytes += temp * (max + 1);
-    }
-
-    if (output_unicode!=0) {
-      if (suppress_finalsize==0 && check_dupes==0) {
-        extra_unicode_bytes = 0;
-        for (j = 0; j < max; j++) {
-          if (options.pattern_info[j].is_fixed!=0 || options.pattern_info[j].cset==NULL || options.pattern_info[j].clen==0)
-            extra_unicode_bytes += (getmblen(options.pattern[j])-1)*temp;
-          else
-            extra_unicode_bytes += (wcstombs(NULL,options.pattern_info[j].cset,0)-options.pattern_info[j].clen)*temp/options.pattern_info[j].clen;
-        }
-        *bytes += extra_unicode_bytes;
+      for (i = 0; i < p->clen; i++) {
+        x = rank_char(&ri, p->cset[i]);
+        n = rank_step(&ri, k, c, r, x);
+        if (index < n || i == p->clen-1)
+          break;
+        index -= n;
       }
-      else
-        suppress_finalsize = 1;
+      block[pos] = p->cset[i];
     }
+    r = (x == c && ri.limit[c] != NPOS) ? r+1 : 1;
+    c = x;
   }
+  free_rankinfo(&ri);
 }
 
-static int finished(const wchar_t *block, const options_type options) {
-size_t i;
-  if (options.pattern == NULL) {
-    for (i = 0; i < wcslen(block); i++)
-      if (inc[i] < options.clen-1)
-        return 0;
+/* index of word in the output of chunk() from startstring on */
+static unsigned long long rank_keyspace(const wchar_t *word, size_t len, const options_type *options) {
+unsigned long long total = 0;
+size_t l;
+
+  for (l = options->min; l < len; l++)
+    total = add_sat(total, count_words(l, options));
+  total = add_sat(total, rank_word(word, len, options));
+  if (options->startstring != NULL)
+    total -= rank_word(options->startstring, options->min, options);
+  return total;
+}
+
+/* number of words chunk() makes from startstring to endstring */
+static unsigned long long count_keyspace(const options_type *options) {
+unsigned long long total = 0;
+size_t l;
+
+  if (options->endstring != NULL)
+    return add_sat(rank_keyspace(options->endstring, options->max, options), 1);
+
+  for (l = options->min; l <= options->max; l++)
+    total = add_sat(total, count_words(l, options));
+  if (options->startstring != NULL)
+    total -= rank_word(options->startstring, options->min, options);
+  return total;
+}
+
+/* load word with the one chunk() writes at index, counting from startstring.
+   Returns its length, 0 if the keyspace is shorter than that */
+static size_t unrank_keyspace(wchar_t *word, unsigned long long index, const options_type *options) {
+unsigned long long n;
+size_t l;
+
+  if (options->startstring != NULL) {
+    n = rank_word(options->startstring, options->min, options);
+    if (index > ULLONG_MAX - n)
+      return 0;
+    index += n;
   }
-  else {
-    for (i = 0; i < wcslen(block); i++) {
-      if (((options.pattern[i] == L'@') && (inc[i] < options.clen-1) && (options.literalstring[i] != L'@')) || \
-          ((options.pattern[i] == L',') && (inc[i] < options.ulen-1) && (options.literalstring[i] != L',')) || \
-          ((options.pattern[i] == L'%') && (inc[i] < options.nlen-1) && (options.literalstring[i] != L'%')) || \
-          ((options.pattern[i] == L'^') && (inc[i] < options.slen-1) && (options.literalstring[i] != L'^'))) {
-        return 0;
-      }
+
+  for (l = options->min; l <= options->max; l++) {
+    n = count_words(l, options);
+    if (index < n) {
+      unrank_word(word, l, index, options);
+      return l;
     }
+    index -= n;
   }
-  return 1;
+  return 0;
+}
+
+/* bytes of every line of length len with its newline.  Only when
+   options->uniform_width is set are they all the same */
+static size_t line_bytes(size_t len, const options_type *options) {
+const struct pinfo *p = options->pattern_info;
+size_t i, n = 1;
+
+  for (i = 0; i < len; i++, p++)
+    n += p->is_fixed ? p->fixedlen : p->syms->len[0];
+  return n;
+}
+
+/* bytes chunk() writes before the word at keyspace index, counting from
+   startstring.  Needs options->uniform_width */
+static unsigned long long keyspace_bytes(unsigned long long index, const options_type *options) {
+unsigned long long n, total = 0;
+size_t l;
+
+  for (l = options->min; l <= options->max && index > 0; l++) {
+    n = count_words(l, options);
+    if (l == options->min && options->startstring != NULL)
+      n -= rank_word(options->startstring, options->min, options);
+    if (n > index)
+      n = index;
+    total += n*line_bytes(l, options);
+    index -= n;
+  }
+  return total;
+}
+
+/* set inc_at_last and inc_at_end from scratch once inc[] is loaded for a word of length len */
+static void count_inc(const wchar_t *block, size_t len, const options_type *options) {
+const struct plan *pl = options->plan;
+size_t v, k;
+
+  inc_at_last = inc_at_end = 0;
+  for (v = 0; v < pl->nvars_len[len]; v++) {
+    if (inc[pl->vars[v].pos] == pl->vars[v].clen-1)
+      inc_at_last++;
+    if (inc[pl->vars[v].pos] == pl->vars[v].end_index)
+      inc_at_end++;
+  }
+
+  if (pl->check_dupes)
+    for (k = 0; k < len; k++)
+      run[inverted ? len-1-k : k] = count_run(block, inverted ? len-1-k : k, len);
+}
+
+static void move_inc(const struct pvar *v, size_t from, size_t to) {
+  inc_at_last += (size_t)(to == v->clen-1) - (size_t)(from == v->clen-1);
+  inc_at_end += (size_t)(to == v->end_index) - (size_t)(from == v->end_index);
+}
+
+/* every variable position is on the last character of its charset */
+static int finished(size_t len, const options_type *options) {
+  return inc_at_last == options->plan->nvars_len[len];
+}
+
+/* the word is the one given with -e */
+static int reached_endstring(size_t len, const options_type *options) {
+  return options->endstring != NULL && len == options->max && inc_at_end == options->plan->nvars_len[len];
+}
+
+/* smallest -d limit among the charsets holding c */
+static size_t char_dupe_limit(wchar_t c, const options_type *options) {
+size_t limit, k;
+
+  if ((unsigned long)c < 256)
+    return options->plan->dupe_limit[c];
+
+  limit = (size_t)-1;
+  for (k = 0; k < 4; k++)
+    if (options->duplicates[k] < limit && symtab_index(&options->symtabs[k], c) != NPOS)
+      limit = options->duplicates[k];
+  return limit;
 }
 
-static int too_many_duplicates(const wchar_t *block, const options_type options) {
+static int too_many_duplicates(const wchar_t *block, size_t len, const options_type *options) {
 wchar_t current_char = L'\0';
 size_t dupes_seen = 0;
+size_t limit = (size_t)-1; /* allowed duplicates of current_char */
+size_t i;
 
-  while (*block != L'\0') {
-    if (*block == current_char) {
-      dupes_seen += 1;
+  if (options->plan->check_dupes == 0)
+    return 0;
+
+  for (i = 0; i < len; i++) {
+    if (block[i] == current_char) {
       /* check for overflow of duplicates */
-      if (dupes_seen > options.duplicates[0]) {
-        if (find_index(options.low_charset, options.clen, current_char) != NPOS)
-          return 1;
-      }
-      if (dupes_seen > options.duplicates[1]) {
-        if (find_index(options.upp_charset, options.ulen, current_char) != NPOS)
-          return 1;
-      }
-      if (dupes_seen > options.duplicates[2]) {
-        if (find_index(options.num_charset, options.nlen, current_char) != NPOS)
-          return 1;
-      }
-      if (dupes_seen > options.duplicates[3]) {
-        if (find_index(options.sym_charset, options.slen, current_char) != NPOS)
-          return 1;
-      }
+      if (++dupes_seen > limit)
+        return 1;
     }
     else {
-      current_char = *block;
+      current_char = block[i];
       dupes_seen = 1;
+      limit = char_dupe_limit(current_char, options);
     }
-    block++;
   }
   return 0;
 }
 
-static void increment(wchar_t *block, const options_type options) {
-size_t i, start, stop;
-int step;
-size_t blocklen = wcslen(block);
-size_t violator_pos = NPOS;
-int can_inc_before_violator = 0; /*bool*/
-int reached_violator = 0; /*bool*/
-wchar_t prev_char = L'\0';
-size_t consecutive_dupes = 0;
+/* length of the run ending at pos, run[] must be valid for the positions
+   in front of it.  pos-1 wraps around at the slow changing end */
+static size_t count_run(const wchar_t *block, size_t pos, size_t len) {
+size_t prev = inverted ? pos+1 : pos-1;
 
-const wchar_t *matching_set;
-size_t mslen = 0;
+  if (prev >= len || block[prev] != block[pos])
+    return 1;
+  return run[prev]+1;
+}
 
-  if ((options.low_charset == NULL) || (options.upp_charset == NULL) || (options.num_charset == NULL) || (options.sym_charset == NULL)) {
-     fprintf(stderr,"increment: SOMETHING REALLY BAD HAPPENED\n");
-     exit(EXIT_FAILURE);
-  }
+/* bool. the run ending at pos only covers positions that can't change,
+   so every word of this length has it */
+static int hopeless_run(size_t pos, const options_type *options) {
+const struct plan *pl = options->plan;
+size_t r = run[pos];
 
-  /*
-      Starting at the "beginning" of string (assuming !inverted),
-      find first character which violates max duplicates
-      which is NOT a fixed character.
-      Be aware that block2 may contain e.g.
-      "dddaaa" but if pattern is "ddd@@@" only the 'a's should
-      can be examined.  This is necessary because permute may
-      be in use and we obviously can't skip over combinations of duplicate
-      characters which are used as placeholders for the permuted words.
-
-      If we do find such a character we will be forcing an increment
-      at that position (or in front of it) and zero everything behind it.
-
-      There must be one incrementable before that position though,
-      otherwise we are completely done and can ignore what we found above.
-      If this check wasn't done we'd run through the end because
-      finish() and everything else expects that last combination
-      to be returned even if it has too many dupes.
-  */
+  for (; r > 0; r--, pos = inverted ? pos+1 : pos-1)
+    if (pl->vindex[pos] != NPOS && pl->vars[pl->vindex[pos]].clen > 1)
+      return 0;
+  return 1;
+}
 
-  if (inverted == 1) {
-    start = blocklen-1;
-    stop = (size_t)-1;
-    step = -1;
-  }
-  else {
-    start = 0;
-    stop = blocklen;
-    step = 1;
-  }
+/* give pos and the positions after it (towards the fast changing end) the
+   smallest values -d accepts, the ones in front of it are left alone.
+   Returns 1 on success, 0 if nothing fits behind the current prefix and -1
+   if no word of this length can get past -d at all */
+static int fill_valid(wchar_t *block, size_t pos, size_t len, const options_type *options) {
+const struct plan *pl = options->plan;
+const struct pvar *v;
+size_t next = inverted ? pos-1 : pos+1;
+size_t i;
+int r;
+
+  if (pos >= len)
+    return 1;
 
-  for (i = start; i != stop; i += step) {
-    if (options.pattern == NULL || (wcschr(L"@,%^",options.pattern[i])!=NULL
-        && options.pattern[i]!=options.literalstring[i])) {
+  if (pl->vindex[pos] == NPOS) {
+    run[pos] = count_run(block, pos, len);
+    if (run[pos] <= char_dupe_limit(block[pos], options))
+      return fill_valid(block, next, len, options);
+    return hopeless_run(pos, options) ? -1 : 0;
+  }
 
-      if (can_inc_before_violator==0 && inc[i] < options.pattern_info[i].clen-1)
-        can_inc_before_violator = 1;
+  v = &pl->vars[pl->vindex[pos]];
+  for (i = 0; i < v->clen; i++) {
+    move_inc(v, inc[pos], i);
+    inc[pos] = i;
+    block[pos] = v->cset[i];
+    run[pos] = count_run(block, pos, len);
+    if (run[pos] <= char_dupe_limit(block[pos], options)) {
+      if ((r = fill_valid(block, next, len, options)) != 0)
+        return r;
+    }
+    else if (hopeless_run(pos, options))
+      return -1;
+  }
+  return 0;
+}
 
-      if (block[i] == prev_char) {
-        if (++consecutive_dupes > options.pattern_info[i].duplicates) {
-          if (can_inc_before_violator==1)
-            violator_pos = i; /* Found him.  Bad boy! */
+/* -d search behind increment() and make_valid().  Bumps the k-th variable
+   position counted from the fast changing end, or one in front of it, and
+   refills everything behind it with the smallest values -d accepts.  When no
+   such word is left the last word of the odometer is loaded so finished()
+   ends the loop, too_many_duplicates() keeps it from being printed */
+static size_t next_valid(wchar_t *block, size_t len, size_t k, const options_type *options) {
+const struct plan *pl = options->plan;
+const struct pvar *v;
+size_t nv = pl->nvars_len[len];
+size_t i, pos;
+int r = 0;
+
+  for (; k < nv && r >= 0; k++) {
+    v = &pl->vars[inverted ? k : nv-1-k];
+    pos = v->pos;
+    for (i = inc[pos]+1; i < v->clen; i++) {
+      move_inc(v, inc[pos], i);
+      inc[pos] = i;
+      block[pos] = v->cset[i];
+      run[pos] = count_run(block, pos, len);
+      if (run[pos] <= char_dupe_limit(block[pos], options)) {
+        if ((r = fill_valid(block, inverted ? pos-1 : pos+1, len, options)) > 0)
+          return pos;
+        if (r < 0)
           break;
-        }
-      }
-      else {
-        prev_char = block[i];
-        consecutive_dupes = 1;
       }
     }
-    else
-      prev_char = L'\0';
   }
 
-  /* increment from end of string */
+  for (k = 0; k < nv; k++) {
+    v = &pl->vars[k];
+    move_inc(v, inc[v->pos], v->clen-1);
+    inc[v->pos] = v->clen-1;
+    block[v->pos] = v->cset[v->clen-1];
+  }
+  return NPOS;
+}
+
+/* move a start word -d rejects forward to the first word it accepts.
+   count_inc() must have been called for block */
+static void make_valid(wchar_t *block, size_t len, const options_type *options) {
+const struct plan *pl = options->plan;
+size_t nv = pl->nvars_len[len];
+size_t k, pos, q = 0;
 
-  if (inverted == 0) {
-    start = blocklen-1;
-    stop = (size_t)-1;
-    step = -1;
+  if (pl->check_dupes == 0)
+    return;
+
+  /* q is the first position from the slow changing end breaking -d */
+  for (k = 0; k < len; k++) {
+    q = inverted ? len-1-k : k;
+    if (run[q] > char_dupe_limit(block[q], options))
+      break;
   }
-  else {
-    start = 0;
-    stop = blocklen;
-    step = 1;
+  if (k == len)
+    return;
+
+  /* the word can only be repaired at q or in front of it */
+  for (k = 0; k < nv; k++) {
+    pos = pl->vars[inverted ? k : nv-1-k].pos;
+    if (inverted ? pos >= q : pos <= q)
+      break;
   }
+  (void)next_valid(block, len, k, options);
+}
 
-  if (violator_pos == NPOS)
-    reached_violator = 1; /*already handled because wasn't there to begin with*/
+/* advance block to the next word.  Returns the position where the carry
+   stopped, positions between it and the fast changing end were reset.
+   Returns NPOS if every position wrapped around, or with -d if no word is
+   left and next_valid() loaded the last one */
+static size_t increment(wchar_t *block, size_t len, const options_type *options) {
+const struct plan *pl = options->plan;
+const struct pvar *v;
+size_t nv = pl->nvars_len[len];
+size_t k, pos;
 
-  for (i = start; i != stop; i += step) {
-    if (i==violator_pos)
-      reached_violator = 1;
+  /*
+      Only the variable positions from the plan are visited, fixed
+      characters of the pattern never change.
 
-    if (options.pattern == NULL) {
-      matching_set = options.low_charset;
-      mslen = options.clen;
-    }
-    else {
-      switch (options.pattern[i]) {
-        case L'@':
-          matching_set = options.low_charset;
-          mslen = options.clen;
-          break;
-        case L',':
-          matching_set = options.upp_charset;
-          mslen = options.ulen;
-          break;
-        case L'%':
-          matching_set = options.num_charset;
-          mslen = options.nlen;
-          break;
-        case L'^':
-          matching_set = options.sym_charset;
-          mslen = options.slen;
-          break;
-        default:
-          matching_set = NULL;
-      }
-    }
-    if (matching_set == NULL || (options.pattern != NULL && options.literalstring[i] == options.pattern[i])) {
-      /* options.pattern cannot be null here due to logic above at top of loop */
-      block[i] = options.pattern[i]; /* add pattern letter to word */
-    }
-    else {
-      if (inc[i] < mslen-1 && reached_violator==1) {
-        block[i] = matching_set[++inc[i]];
-        break;
-      }
-      else {
-        block[i] = matching_set[0];
-        inc[i] = 0;
-      }
+      With -d every word handed out already passes too_many_duplicates():
+      next_valid() keeps the run length of each position and jumps over
+      whole ranges of rejected words instead of stepping through them.
+  */
+  if (pl->check_dupes)
+    return next_valid(block, len, 0, options);
+
+  /* increment from end of string */
+
+  for (k = 0; k < nv; k++) {
+    v = &pl->vars[inverted ? k : nv-1-k];
+    pos = v->pos;
+
+    if (inc[pos] < v->clen-1) {
+      move_inc(v, inc[pos], inc[pos]+1);
+      block[pos] = v->cset[++inc[pos]];
+      return pos;
     }
+    move_inc(v, inc[pos], 0);
+    block[pos] = v->cset[0];
+    inc[pos] = 0;
   }
+  return NPOS;
 }
 
 static void *PrintPercentage(void *threadarg) {
@@ -1075,49 +3380,31 @@ unsigned long long calc = 0;
 }
 
 static void renamefile(const size_t end, const char *fpath, const char *outputfilename, const char *compressalgo) {
-FILE *optr;     /* ptr to START output file; will be renamed later */
-char *newfile;  /* holds the new filename */
 char *finalnewfile; /*final filename with escape characters */
-char *comptype; /* build -t string for 7z */
-char *compoutput; /* build archive string for 7z */
-char *findit = NULL;   /* holds location of / character */
+char *ckpt;           /* START.ckpt */
+const char *ext = ""; /* -z finalnewfile in process: .gz and so on */
 int status;     /* rename returns int */
-char buff[512]; /* buffer to hold line from wordlist */
-pid_t pid; /*  pid and pid return */
+char first[512], buff[512]; /* first and last line from wordlist */
 
   errno=0;
   memset(buff,0,sizeof(buff));
 
   fprintf(stderr,"\ncrunch: %3d%% completed generating output\n", (int)(100L * my_thread.linetotal / my_thread.finallinecount));
 
-  finalnewfile = calloc((end*3)+5+strlen(fpath), sizeof(char)); /* max length will be 3x outname */
-  if (finalnewfile == NULL) {
-    fprintf(stderr,"rename: can't allocate memory for finalnewfile\n");
-    exit(EXIT_FAILURE);
-  }
-
-  newfile = calloc((end*3)+5+strlen(fpath), sizeof(char)); /* max length will be 3x outname */
-  if (newfile == NULL) {
-    fprintf(stderr,"rename: can't allocate memory for newfile\n");
-    exit(EXIT_FAILURE);
+  if (out.z != NULL) { /* already compressed, only the end of the stream is missing */
+    out_zfinish(fpath);
+    ext = out_zext[out.z->algo];
   }
 
-  if (compressalgo != NULL) {
-    comptype = calloc(strlen(compressalgo)+3, sizeof(char)); /* -t bzip2 plus CR */
-    if (newfile == NULL) {
-      fprintf(stderr,"rename: can't allocate memory for comptype\n");
+  if (strncmp(outputfilename, fpath, strlen(fpath)) != 0) {
+    finalnewfile = calloc((end*3)+5+strlen(fpath)+strlen(outputfilename)+strlen(ext), sizeof(char)); /* max length will be 3x outname */
+    if (finalnewfile == NULL) {
+      fprintf(stderr,"rename: can't allocate memory for finalnewfile\n");
       exit(EXIT_FAILURE);
     }
-  }
-
-  compoutput = calloc((end*3)+5+strlen(fpath), sizeof(char)); /* max length will be 3x outname */
-  if (newfile == NULL) {
-    fprintf(stderr,"rename: can't allocate memory for compoutput\n");
-    exit(EXIT_FAILURE);
-  }
-
-  if (strncmp(outputfilename, fpath, strlen(fpath)) != 0) {
-    status = rename(fpath, outputfilename); /* rename from START to user specified name */
+    strcat(finalnewfile, outputfilename);
+    strcat(finalnewfile, ext);
+    status = rename(fpath, finalnewfile); /* rename from START to user specified name */
     if (status != 0) {
       fprintf(stderr,"Error renaming file.  Status1 = %d  Code = %d\n",status,errno);
       fprintf(stderr,"The problem is = %s\n", strerror(errno));
@@ -1125,39 +3412,12 @@ pid_t pid; /*  pid and pid return */
     }
   }
   else {
-    if ((optr = fopen(fpath,"r")) == NULL) {
-      fprintf(stderr,"rename: File START could not be opened\n");
-      exit(EXIT_FAILURE);
-    }
-    else {  /* file opened above now read first line */
-      (void)fgets(buff, (int)sizeof(buff), optr);
-      strncat(newfile, buff, strlen(buff)-1); /* get rid of CR */
-      while (feof(optr) == 0) {
-        (void)fgets(buff, (int)sizeof(buff), optr);
-      } /* all of this just to get last line */
-      if (fclose(optr) != 0) {
-        fprintf(stderr,"rename: fclose returned error number = %d\n", errno);
-        fprintf(stderr,"The problem is = %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-      }
-    }
-    strcat(newfile, "-"); /* build new filename */
-    strncat(newfile, buff, strlen(buff)-1); /* get rid of CR */
-
-    strncpy(finalnewfile,fpath,strlen(fpath)-5);
-
-    findit = strstr(newfile,"/");
-    if (findit == NULL) {
-      strncat(finalnewfile,newfile,strlen(newfile));
-      strncat(finalnewfile, ".txt", 4);
-    }
-    else {
-      while ((findit = strchr(newfile, '/')) != NULL) {
-        *findit++ = ' ';
-      }
-      strncat(finalnewfile,newfile,strlen(newfile));
-      strncat(finalnewfile, ".txt", 4);
-    }
+    /* the output layer kept both ends, no need to read the file back */
+    out_end(first, sizeof(first), 0);
+    out_end(buff, sizeof(buff), 1);
+    first[strcspn(first, "\n")] = '\0'; /* get rid of CR */
+    buff[strcspn(buff, "\n")] = '\0';
+    finalnewfile = split_name(fpath, first, buff, ext);
 
     status = rename(fpath, finalnewfile); /* rename START to proper filename */
     if (status != 0) {
@@ -1167,148 +3427,213 @@ pid_t pid; /*  pid and pid return */
     }
   }
 
-  if (compressalgo != NULL) {
-    /*@-type@*/
-    pid = fork();
-    (void)wait(&status);
+  ckpt = checkpoint_name(fpath); /* START is done with */
+  (void)remove(ckpt);
+  free(ckpt);
 
-    /*@=type@*/
-    if (pid == 0) {
-      strncat(comptype,"-t", 2);
-      strncat(comptype, compressalgo, strlen(compressalgo));
+  if (out.z != NULL && out.z->indexed)
+    out_zindex(finalnewfile);
+  if (manifest != NULL)
+    out_manifest(finalnewfile, (out.z == NULL) ? compressalgo : NULL);
 
-      if (strncmp(outputfilename, fpath, 5) == 0) {
-        strcat(compoutput, finalnewfile);
+  if (compressalgo != NULL && out.z == NULL) /* 7z, or crunch was built without the library */
+    zprog_start(finalnewfile, compressalgo);
+  free(finalnewfile);
+}
 
-        if (strncmp(compressalgo, "lzma", 4) == 0) {
-          fprintf(stderr,"Beginning lzma compression.  Please wait.\n");
-          status=execlp(compressalgo, compressalgo, "-9", "-f", "-v", finalnewfile, NULL);
-        }
-        if (strncmp(compressalgo, "bzip2", 5) == 0) {
-          fprintf(stderr,"Beginning bzip2 compression.  Please wait.\n");
-          status=execlp(compressalgo, compressalgo, "-9", "-f", "-v", finalnewfile, NULL);
-        }
-        if (strncmp(compressalgo, "gzip", 4) == 0) {
-          fprintf(stderr,"Beginning gzip compression.  Please wait.\n");
-          status=execlp(compressalgo, compressalgo, "-9", "-f", "-v", finalnewfile, NULL);
-        }
-        if (strncmp(compressalgo, "7z", 2) == 0) {
-          strcat(compoutput, ".7z");
-          status=execlp("7z", "7z", "a", comptype, "-mx=9", compoutput, finalnewfile, NULL);
-        }
-      }
-      else {
-        strcat(compoutput, outputfilename);
+/* the name a -b/-c file next to fpath (START) gets from its first and last
+   words: first-last.txt, with any / made a space */
+static char *split_name(const char *fpath, const char *first, const char *last, const char *ext) {
+size_t dir = strlen(fpath) - 5;
+char *name, *findit;
 
-        if (strncmp(compressalgo, "lzma", 4) == 0) {
-          strcat(compoutput, ".lzma");
-          fprintf(stderr,"Beginning lzma compression.  Please wait.\n");
-          status=execlp(compressalgo, compressalgo, "-9", "-f", "-v", outputfilename, NULL);
-        }
-        if (strncmp(compressalgo, "bzip2", 5) == 0) {
-          fprintf(stderr,"Beginning bzip2 compression.  Please wait.\n");
-          status=execlp(compressalgo, compressalgo, "-9", "-f", "-v", outputfilename, NULL);
-        }
-        if (strncmp(compressalgo, "gzip", 4) == 0) {
-          fprintf(stderr,"Beginning gzip compression.  Please wait.\n");
-          status=execlp(compressalgo, compressalgo, "-9", "-f", "-v", outputfilename, NULL);
-        }
-        if (strncmp(compressalgo, "7z", 2) == 0) {
-          strcat(compoutput, ".7z");
-          status=execlp("7z", "7z", "a", comptype, "-mx=9", compoutput, outputfilename, NULL);
-        }
-      }
+  name = calloc(dir + strlen(first) + strlen(last) + 6 + strlen(ext), sizeof(char));
+  if (name == NULL) {
+    fprintf(stderr,"rename: can't allocate memory for finalnewfile\n");
+    exit(EXIT_FAILURE);
+  }
+  strncpy(name, fpath, dir);
+  strcat(name, first);
+  strcat(name, "-");
+  strcat(name, last);
+  while ((findit = strchr(&name[dir], '/')) != NULL)
+    *findit = ' ';
+  strcat(name, ".txt");
+  strcat(name, ext);
+  return name;
+}
 
-      if (status != 0) {
-        fprintf(stderr,"Error compressing file.  Status = %d  Code = %d\n", status, errno);
-        fprintf(stderr,"The problem is = %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-      }
+/* what the -z program adds to the name of the file it compresses */
+static const char *zprog_ext(const char *compressalgo) {
+int k;
 
-      if (strncmp(compressalgo, "lzma", 4) != 0) {
-        if (strncmp(outputfilename, fpath, 5) == 0)
-          status = remove(finalnewfile);
-        else
-          status = remove(outputfilename);
+  for (k = 1; k < (int)(sizeof(out_zname)/sizeof(out_zname[0])); k++)
+    if (strcmp(compressalgo, out_zname[k]) == 0)
+      return out_zext[k];
+  return ".7z";
+}
 
-        if (status != 0) {
-          fprintf(stderr,"Error deleting file.  Status = %d  Code = %d\n", status, errno);
-          fprintf(stderr,"The problem is = %s\n", strerror(errno));
-          exit(EXIT_FAILURE);
-        }
-      }
+/* run the -z program on file in the background.  zprog_reap waits for it */
+static void zprog_start(const char *file, const char *compressalgo) {
+char *comptype; /* build -t string for 7z */
+char *compoutput; /* build archive string for 7z */
+pid_t pid; /*  pid and pid return */
+
+  comptype = calloc(strlen(compressalgo)+3, sizeof(char)); /* -t bzip2 plus CR */
+  if (comptype == NULL) {
+    fprintf(stderr,"rename: can't allocate memory for comptype\n");
+    exit(EXIT_FAILURE);
+  }
+  compoutput = calloc(strlen(file)+4, sizeof(char)); /* name plus .7z */
+  if (compoutput == NULL) {
+    fprintf(stderr,"rename: can't allocate memory for compoutput\n");
+    exit(EXIT_FAILURE);
+  }
+  strncat(comptype,"-t", 2);
+  strncat(comptype, compressalgo, strlen(compressalgo));
+  strcat(compoutput, file);
+  strcat(compoutput, ".7z");
+
+  zprog_reap(maxzprogs-1); /* wait for room */
+  if (zprogs == NULL && (zprogs = calloc(maxzprogs, sizeof(struct zprog))) == NULL) {
+    fprintf(stderr,"rename: can't allocate memory for zprogs\n");
+    exit(EXIT_FAILURE);
+  }
+  if ((zprogs[nzprogs].file = malloc(strlen(file)+1)) == NULL) {
+    fprintf(stderr,"rename: can't allocate memory for zprogs\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(zprogs[nzprogs].file, file);
+  zprogs[nzprogs].is7z = (strncmp(compressalgo, "7z", 2) == 0);
+
+  /*@-type@*/
+  pid = fork();
+  /*@=type@*/
+  if (pid == 0) {
+    if (strncmp(compressalgo, "7z", 2) == 0)
+      (void)execlp("7z", "7z", "a", comptype, "-mx=9", compoutput, file, NULL);
+    else {
+      fprintf(stderr,"Beginning %s compression.  Please wait.\n", compressalgo);
+      (void)execlp(compressalgo, compressalgo, "-9", "-f", "-v", file, NULL);
     }
+    fprintf(stderr,"Error compressing file.  Code = %d\n", errno);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    _exit(EXIT_FAILURE);
   }
-  free(newfile);
-  free(finalnewfile);
+  if (pid < 0) {
+    fprintf(stderr,"Error compressing file %s\n", file);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  zprogs[nzprogs++].pid = pid; /* and on to the next file */
+  free(comptype);
   free(compoutput);
-  if (compressalgo != NULL)
-    free(comptype);
 }
 
+/* --manifest: add a line for the file renamefile just finished, from what
+   the output layer kept of it.  compressalgo is the program about to be
+   run on it, whose extension the name gets */
+static void out_manifest(const char *fpath, const char *compressalgo) {
+const char *ext = (compressalgo != NULL) ? zprog_ext(compressalgo) : "";
+char *name;
+char first[OUT_ENDS], last[OUT_ENDS];
+wchar_t *word;
+unsigned long long rank = ULLONG_MAX;
+
+  out_end(first, sizeof(first), 0);
+  out_end(last, sizeof(last), 1);
+  first[strcspn(first, "\n")] = '\0';
+  last[strcspn(last, "\n")] = '\0';
+  if (manifest_options != NULL && first[0] != '\0') { /* the way -r finds its place */
+    word = alloc_wide_string(first, NULL);
+    rank = rank_keyspace(word, wcslen(word), manifest_options);
+    free(word);
+  }
 
-static void printpermutepattern(const wchar_t *block2, const wchar_t *pattern, const wchar_t *literalstring, wchar_t **wordarray) {
-size_t j, t;
-char mb[MB_CUR_MAX+1];
-int mblen = 0;
+  if ((name = malloc(strlen(fpath) + strlen(ext) + 1)) == NULL) {
+    fprintf(stderr,"crunch: can't allocate memory for the manifest\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(name, fpath);
+  strcat(name, ext);
+  manifest_add(name, out.filebytes, out.filewords, out.crc, rank, first, last);
+  free(name);
+}
+
+/* --manifest: a tab separated line of name, bytes, words, CRC-32, number
+   of the first word in crunch's output (- for permute), first and last
+   word */
+static void manifest_add(const char *name, unsigned long long bytes, unsigned long long words, unsigned long crc, unsigned long long rank, const char *first, const char *last) {
+FILE *fp;
+
+  if ((fp = fopen(manifest, "a")) == NULL) {
+    fprintf(stderr,"crunch: can't open the manifest %s\n", manifest);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (rank == ULLONG_MAX)
+    fprintf(fp, "%s\t%llu\t%llu\t%08lx\t-\t%s\t%s\n", name, bytes, words, crc, first, last);
+  else
+    fprintf(fp, "%s\t%llu\t%llu\t%08lx\t%llu\t%s\t%s\n", name, bytes, words, crc, rank, first, last);
+  if (fclose(fp) != 0) {
+    fprintf(stderr,"crunch: can't write the manifest %s\n", manifest);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* wait for compressor programs, oldest first, until no more than keep are
+   still running */
+static void zprog_reap(size_t keep) {
+int status;
+
+  while (nzprogs > keep) {
+    if (waitpid(zprogs[0].pid, &status, 0) != zprogs[0].pid) {
+      if (errno == EINTR)
+        continue;
+      status = -1;
+    }
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr,"Error compressing file %s\n", zprogs[0].file);
+      exit(EXIT_FAILURE);
+    }
+
+    /* gzip, bzip2 and lzma remove the file they compressed, 7z leaves it */
+    if (zprogs[0].is7z && remove(zprogs[0].file) != 0) {
+      fprintf(stderr,"Error deleting file.  Code = %d\n", errno);
+      fprintf(stderr,"The problem is = %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    free(zprogs[0].file);
+    memmove(&zprogs[0], &zprogs[1], (--nzprogs)*sizeof(struct zprog));
+  }
+}
 
-  for (t = 0, j = 0; t < wcslen(pattern); t++) {
-    if ((pattern[t] == L'@') || (pattern[t] == L',') || (pattern[t] == L'%') ||  (pattern[t] == L'^')) {
-      switch (pattern[t]) {
-      case L'@':
-        if (literalstring[t] == L'@') {
-          fprintf(fptr, "@");
-          break;
-        }
-        /*@fallthrough@*/
-      case L',':
-        if (literalstring[t] == L',') {
-          fprintf(fptr, ",");
-          break;
-        }
-        /*@fallthrough@*/
-      case L'%':
-        if (literalstring[t] == L'%') {
-          fprintf(fptr, "%%");
-          break;
-        }
-        /*@fallthrough@*/
-      case L'^':
-        if (literalstring[t] == L'^') {
-          fprintf(fptr, "^");
-          break;
-        }
-        /*@fallthrough@*/
-      default:
-        /*fprintf(fptr, "%c", block2[t]);*/
-        if (!output_unicode)
-          fprintf(fptr, "%c", (char)(block2[t]&0xFF));
-        else {
-          mblen = wctomb(mb,block2[t]);
-          if (mblen == -1) {
-            fprintf(stderr,"Error: wctomb failed for char U+%04lX\n",(unsigned long)block2[t]);
-            exit(EXIT_FAILURE);
-          }
-          mb[mblen]='\0';
-          fprintf(fptr, "%s", mb);
 
-          if (mblen > 1) {
-            /* bytecounter will be incremented by 1 below, so just do one less here*/
-            my_thread.bytecounter += (mblen-1);
-          }
-        }
-      }
-      my_thread.bytecounter+=1;
+static void printpermutepattern(wchar_t **wordarray, const options_type *options) {
+const struct pinfo *p = options->pattern_info;
+const struct symtab *st;
+size_t j, t, n;
+
+  for (t = 0, j = 0; t < options->plen; t++, p++) {
+    if (!p->is_fixed) {
+      st = p->syms;
+      out_write(&st->bytes[inc[t]*st->width], st->len[inc[t]]);
+      my_thread.bytecounter += st->len[inc[t]];
+    }
+    else if (p->is_literal) {
+      out_write(p->fixed, p->fixedlen);
+      my_thread.bytecounter += p->fixedlen;
     }
     else {
-      (void)make_narrow_string(gconvbuffer,wordarray[j],gconvlen);
-      fprintf(fptr, "%s", gconvbuffer);
-      my_thread.bytecounter+=strlen(gconvbuffer);
+      n = make_narrow_string(gconvbuffer,wordarray[j],gconvlen);
+      out_write(gconvbuffer, n);
+      my_thread.bytecounter += n;
 
       j++;
     }
   }
-  fprintf(fptr, "\n");
+  out_write("\n", 1);
   my_thread.bytecounter++;
   my_thread.linecounter++;
 }
@@ -1342,10 +3667,9 @@ wchar_t *block2;      /* block is word being created */
     if (outputfilename == NULL) {
       if (options.pattern == NULL) {
         for (t = 0; t < sizePerm; t++) {
-          (void)make_narrow_string(gconvbuffer,wordarray[t],gconvlen);
-          fprintf(fptr, "%s", gconvbuffer);
+          out_write(gconvbuffer, make_narrow_string(gconvbuffer,wordarray[t],gconvlen));
         }
-        fprintf(fptr, "\n");
+        out_write("\n", 1);
       }
       else {
           block2 = calloc(options.plen+1,sizeof(wchar_t)); /* block can't be bigger than max size */
@@ -1354,43 +3678,24 @@ wchar_t *block2;      /* block is word being created */
             exit(EXIT_FAILURE);
           }
 
-          for (t = 0; t < options.plen; t++) {
-            switch (options.pattern[t]) {
-              case L'@':
-                block2[t] = options.low_charset[0]; /* placeholder is set so add character */
-                inc[t] = 0;
-                break;
-              case L',':
-                block2[t] = options.upp_charset[0]; /* placeholder is set so add   character */
-                inc[t] = 0;
-                break;
-              case L'%':
-                block2[t] = options.num_charset[0]; /* placeholder is set so add character */
-                inc[t] = 0;
-                break;
-              case L'^':
-                block2[t] = options.sym_charset[0]; /* placeholder is set so add character */
-                inc[t] = 0;
-                break;
-              default:
-                block2[t] = ' '; /* add pattern letter to word */
-            }
-          } /* for t=0 */
+          for (t = 0; t < options.plen; t++)
+            loadstring(block2, t, NULL, &options);
+          count_inc(block2, options.plen, &options);
+          make_valid(block2, options.plen, &options);
 
-          while (!finished(block2, options) && !ctrlbreak) {
-              if (!too_many_duplicates(block2, options))
-                printpermutepattern(block2, options.pattern, options.literalstring, wordarray);
-              increment(block2, options);
+          while (!finished(options.plen, &options) && !ctrlbreak) {
+              printpermutepattern(wordarray, &options);
+              (void)increment(block2, options.plen, &options);
           }
-          if (!too_many_duplicates(block2, options))
-            printpermutepattern(block2, options.pattern, options.literalstring, wordarray);
+          if (!too_many_duplicates(block2, options.plen, &options))
+            printpermutepattern(wordarray, &options);
           free(block2);
       }
     }
     else {
       size_t outlen;
 
-      if ((fptr = fopen(fpath,"a+")) == NULL) { /* append to file */
+      if (out_open(fpath, 1, 0) != 0) { /* append to file */
         fprintf(stderr,"permute: File START could not be opened\n");
         fprintf(stderr,"The problem is = %s\n", strerror(errno));
         exit(EXIT_FAILURE);
@@ -1404,36 +3709,34 @@ wchar_t *block2;      /* block is word being created */
         if (options.pattern == NULL) {
           if ((my_thread.linecounter <= (linecount-1)) && (my_thread.bytecounter <= (bytecount - wordlength))) { /* not time to create a new file */
             for (t = 0; t < sizePerm; t++) {
-              (void)make_narrow_string(gconvbuffer,wordarray[t],gconvlen);
-              fprintf(fptr, "%s", gconvbuffer);
+              out_write(gconvbuffer, make_narrow_string(gconvbuffer,wordarray[t],gconvlen));
             }
             my_thread.bytecounter+=wordlength;
-            fprintf(fptr, "\n");
+            out_write("\n", 1);
             my_thread.linecounter++;
           }
           else {
             my_thread.bytetotal+=my_thread.bytecounter;
             my_thread.linetotal+=my_thread.linecounter;
 
-            if (fclose(fptr) != 0) {
-              fprintf(stderr,"permute: fclose returned error number = %d\n", errno);
+            if (out_close() != 0) {
+              fprintf(stderr,"permute: close returned error number = %d\n", errno);
               fprintf(stderr,"The problem is = %s\n", strerror(errno));
               exit(EXIT_FAILURE);
             }
 
             renamefile(((wordlength*2)+5), fpath, outputfilename, compressalgo);
-            if ((fptr = fopen(fpath, "w")) == NULL) {
+            if (out_open(fpath, 0, 0) != 0) {
               fprintf(stderr,"permute2: Ouput file START could not be opened\n");
               exit(EXIT_FAILURE);
             }
             my_thread.linecounter = 0;
             my_thread.bytecounter = 0;
             for (t = 0; t < sizePerm; t++) {
-              (void)make_narrow_string(gconvbuffer,wordarray[t],gconvlen);
-              fprintf(fptr, "%s", gconvbuffer);
+              out_write(gconvbuffer, make_narrow_string(gconvbuffer,wordarray[t],gconvlen));
             }
             my_thread.bytecounter+=wordlength;
-            fprintf(fptr, "\n");
+            out_write("\n", 1);
             my_thread.linecounter++;
           }
         }
@@ -1444,53 +3747,34 @@ wchar_t *block2;      /* block is word being created */
             exit(EXIT_FAILURE);
           }
 
-          for (t = 0; t < options.plen; t++) {
-            switch (options.pattern[t]) {
-              case L'@':
-                block2[t] = options.low_charset[0]; /* placeholder is set so add character */
-                inc[t] = 0;
-                break;
-              case L',':
-                block2[t] = options.upp_charset[0]; /* placeholder is set so add   character */
-                inc[t] = 0;
-                break;
-              case L'%':
-                block2[t] = options.num_charset[0]; /* placeholder is set so add character */
-                inc[t] = 0;
-                break;
-              case L'^':
-                block2[t] = options.sym_charset[0]; /* placeholder is set so add character */
-                inc[t] = 0;
-                break;
-              default:
-                block2[t] = L' '; /* add pattern letter to word */
-            }
-          } /* for t=0 */
+          for (t = 0; t < options.plen; t++)
+            loadstring(block2, t, NULL, &options);
+          count_inc(block2, options.plen, &options);
+          make_valid(block2, options.plen, &options);
 
-          while (!finished(block2, options) && !ctrlbreak) {
+          while (!finished(options.plen, &options) && !ctrlbreak) {
             if ((my_thread.linecounter <= (linecount-1)) && (my_thread.bytecounter <= (bytecount - wordlength))) { /* not time to create a new file */
-              if (!too_many_duplicates(block2, options))
-                printpermutepattern(block2, options.pattern, options.literalstring, wordarray);
-              increment(block2, options);
+              printpermutepattern(wordarray, &options);
+              (void)increment(block2, options.plen, &options);
             }
             else {
               my_thread.bytetotal+=my_thread.bytecounter;
               my_thread.linetotal+=my_thread.linecounter;
 
-              if (fptr == NULL) {
+              if (out.fd < 0) {
                 fprintf(stderr,"permute: something really bad happened!\n");
                 exit(EXIT_FAILURE);
               }
               else {
-                if (fclose(fptr) != 0) {
-                  fprintf(stderr,"permute2: fclose returned error number = %d\n", errno);
+                if (out_close() != 0) {
+                  fprintf(stderr,"permute2: close returned error number = %d\n", errno);
                   fprintf(stderr,"The problem is = %s\n", strerror(errno));
                   exit(EXIT_FAILURE);
                 }
               }
 
               renamefile(((wordlength*2)+5), fpath, outputfilename, compressalgo);
-              if ((fptr = fopen(fpath, "w")) == NULL) {
+              if (out_open(fpath, 0, 0) != 0) {
                 fprintf(stderr,"permute2: Ouput file START could not be opened\n");
                 free(block2);
                 exit(EXIT_FAILURE);
@@ -1499,23 +3783,18 @@ wchar_t *block2;      /* block is word being created */
               my_thread.bytecounter = 0;
             }
           }
-          if (!too_many_duplicates(block2, options))
-            printpermutepattern(block2, options.pattern, options.literalstring, wordarray);
+          if (!too_many_duplicates(block2, options.plen, &options))
+            printpermutepattern(wordarray, &options);
           free(block2);
         }
 
-        if (fptr == NULL) {
+        if (out.fd < 0) {
           fprintf(stderr,"permute2: something really bad happened!\n");
           exit(EXIT_FAILURE);
         }
         else {
-          if (ferror(fptr) != 0) {
-            fprintf(stderr,"permute2: fprintf failed = %d\n", errno);
-            fprintf(stderr,"The problem is = %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-          }
-          if (fclose(fptr) != 0) {
-            fprintf(stderr,"permute3: fclose returned error number = %d\n", errno);
+          if (out_close() != 0) {
+            fprintf(stderr,"permute3: close returned error number = %d\n", errno);
             fprintf(stderr,"The problem is = %s\n", strerror(errno));
             exit(EXIT_FAILURE);
           }
@@ -1546,288 +3825,986 @@ wchar_t *temp[1];
       wordarray[outer] = *temp;
     }
   }
-  else {
-    for (t = 0; t < length; t++) {
-      if (!output_unicode)
-        my_thread.bytecounter += wcslen(wordarray[t]);
-      else
-        my_thread.bytecounter += wcstombs(NULL,wordarray[t],0);
+  else {
+    for (t = 0; t < length; t++) {
+      if (!output_unicode)
+        my_thread.bytecounter += wcslen(wordarray[t]);
+      else
+        my_thread.bytecounter += wcstombs(NULL,wordarray[t],0);
+    }
+    my_thread.bytecounter++;
+  }
+}
+
+static void loadstring(wchar_t *block2, const size_t j, const wchar_t *startblock, const options_type *options) {
+const struct pinfo *p = &options->pattern_info[j];
+size_t k;
+
+  if (p->is_fixed) {
+    block2[j] = options->pattern[j]; /* add pattern letter to word */
+  }
+  else if (startblock == NULL) {
+    block2[j] = p->cset[0]; /* placeholder is set so add character */
+    inc[j] = 0;
+  }
+  else {
+    block2[j] = startblock[j];
+    if ((k = symtab_index(p->syms, block2[j])) != NPOS)
+      inc[j] = k;
+  }
+}
+
+static void chunk(const size_t start, const size_t end, const wchar_t *startblock, const options_type options, const char *fpath, const char *outputfilename, const char *compressalgo) {
+size_t i,j;      /* loop counters */
+wchar_t *block2;      /* block is word being created */
+size_t outlen; /* temp for size of narrow output string */
+size_t lineoff[MAXSTRING+1]; /* where each position starts in gconvbuffer */
+size_t maxclen = 0; /* longest charset, 0 if sweep_word is never used */
+int can_sweep = 0; /* bool. sweep_word may be used for this length */
+int dupes; /* bool. -d is in use, which sweep_word can't do */
+size_t n;
+unsigned long long room; /* lines that still fit in the current output file */
+
+  errno = 0;
+  block2 = calloc(end+1,sizeof(wchar_t)); /* block can't be bigger than max size */
+  if (block2 == NULL) {
+    fprintf(stderr,"chunk: can't allocate memory for block2\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (options.endstring == NULL) {
+    dupes = 0;
+    for (j = 0; j < 4; j++)
+      if (options.duplicates[j] != (size_t)-1)
+        dupes = 1;
+    for (j = 0, n = 0; j < end && dupes == 0; j++)
+      if (options.pattern_info[j].clen > n)
+        n = options.pattern_info[j].clen;
+    if (dupes == 0 && n > 1)
+      maxclen = n;
+  }
+
+  for (i = start; (i <= end) && !ctrlbreak; i++) {
+    for (j = 0; j < i; j++) {
+      loadstring(block2, j, startblock, &options);
+    }
+    startblock = NULL;
+    count_inc(block2, i, &options);
+    make_valid(block2, i, &options);
+    outlen = render_word(gconvbuffer, lineoff, 0, i, &options);
+    can_sweep = (maxclen != 0 && sweep_ok(i, &options));
+
+    if (outputfilename == NULL) { /* user wants to display words on screen */
+      if (options.endstring == NULL) {
+        while ((!finished(i, &options) && !ctrlbreak) && (my_thread.linecounter < (linecount-1))) {
+          if (can_sweep && (n = out_sweep(block2, gconvbuffer, lineoff, i, &options, maxclen, linecount-1-my_thread.linecounter)) != 0) {
+            my_thread.linecounter += n;
+            continue;
+          }
+          out_write(gconvbuffer, outlen+1);
+          my_thread.linecounter++;
+          outlen = rerender_word(gconvbuffer, lineoff, increment(block2, i, &options), i, &options);
+        }
+        if (!too_many_duplicates(block2, i, &options)) { /*flush last word */
+          out_write(gconvbuffer, outlen+1);
+        }
+        if (my_thread.linecounter == (linecount-1)) {
+          goto killloop;
+        }
+      }
+      else {
+        while (!finished(i, &options) && !ctrlbreak && !reached_endstring(i, &options)) {
+          out_write(gconvbuffer, outlen+1);
+          my_thread.linecounter++;
+          outlen = rerender_word(gconvbuffer, lineoff, increment(block2, i, &options), i, &options);
+        }
+        if (!too_many_duplicates(block2, i, &options)) { /*flush last word */
+          out_write(gconvbuffer, outlen+1);
+        }
+        if (reached_endstring(i, &options))
+          break;
+      }
+    }
+    else { /* user wants to generate a file */
+      if (out_open(fpath, 1, file_bytes(end)) != 0) { /* append to file */
+        fprintf(stderr,"chunk1: File START could not be opened\n");
+        fprintf(stderr,"The problem is = %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+      else { /* file opened start writing.  file will be renamed when done */
+        while (!finished(i, &options) && !ctrlbreak) {
+          if (reached_endstring(i, &options))
+            break;
+
+          if ((my_thread.linecounter <= (linecount-1)) && (my_thread.bytecounter <= (bytecount - outlen))) { /* not time to create a new file */
+            room = (bytecount - outlen - my_thread.bytecounter)/(outlen+1);
+            if (room > linecount-1-my_thread.linecounter)
+              room = linecount-1-my_thread.linecounter;
+            if (can_sweep && (n = out_sweep(block2, gconvbuffer, lineoff, i, &options, maxclen, room+1)) != 0) {
+              my_thread.bytecounter += (unsigned long long)n*(outlen+1);
+              my_thread.linecounter += n;
+              my_thread.linetotal += n;
+              continue;
+            }
+            out_write(gconvbuffer, outlen+1);
+            my_thread.bytecounter += (unsigned long long)outlen+1;
+            my_thread.linecounter++;
+            my_thread.linetotal++;
+            outlen = rerender_word(gconvbuffer, lineoff, increment(block2, i, &options), i, &options);
+          }
+          else { /* time to create a new file */
+            my_thread.bytetotal+=my_thread.bytecounter;
+
+            if (out_close() != 0) {
+              fprintf(stderr,"chunk1: close returned error number = %d\n",errno);
+              fprintf(stderr,"The problem is = %s\n", strerror(errno));
+              free(block2);
+              exit(EXIT_FAILURE);
+            }
+            renamefile(end, fpath, outputfilename, compressalgo);
+
+            if (!reached_endstring(i, &options)) {
+              my_thread.linecounter = 0;
+              my_thread.bytecounter = 0;
+              if (out_open(fpath, 0, file_bytes(end)) != 0) {
+                fprintf(stderr,"chunk2: Ouput file START could not be opened\n");
+                fprintf(stderr,"The problem is = %s\n", strerror(errno));
+                free(block2);
+                exit(EXIT_FAILURE);
+              }
+            }
+            else {
+              goto killloop;
+            }
+          }
+        }
+
+        if (out.fd < 0) {
+          fprintf(stderr,"chunk: something really bad happened\n");
+          exit(EXIT_FAILURE);
+        }
+        else {
+          if (!too_many_duplicates(block2, i, &options)) {
+            out_write(gconvbuffer, outlen+1); /* flush the last word */
+
+            my_thread.linecounter++;
+            my_thread.linetotal++;
+            my_thread.bytecounter += (unsigned long long)outlen+1;
+          }
+          if (out_close() != 0) {
+            fprintf(stderr,"chunk2: close returned error number = %d\n", errno);
+            fprintf(stderr,"The problem is = %s\n", strerror(errno));
+            free(block2);
+            exit(EXIT_FAILURE);
+          }
+
+          if (reached_endstring(i, &options))
+            break;
+
+          if (ctrlbreak == 1)
+            break;
+        }
+      } /* else from if fopen */
+    } /* else from outputfilename == NULL */
+  } /* for start < end loop */
+
+  if (ctrlbreak == 1 ) {
+    (void)make_narrow_string(gconvbuffer,block2,gconvlen);
+    fprintf(stderr,"Crunch ending at %s\n",gconvbuffer);
+  }
+
+  killloop:
+  my_thread.bytetotal += my_thread.bytecounter;
+
+  if ((outputfilename != NULL) && !ctrlbreak) {
+    renamefile(end, fpath, outputfilename, compressalgo);
+  }
+
+  free(block2);
+}
+
+static void gen_render(struct gen *g, const options_type *options) {
+  g->outlen = render_word(g->line, g->lineoff, 0, g->len, options);
+  g->can_sweep = sweep_ok(g->len, options);
+  g->stale = 0;
+}
+
+/* load the word at keyspace index */
+static void gen_seek(struct gen *g, unsigned long long index, const options_type *options) {
+size_t j;
+
+  g->len = unrank_keyspace(g->block2, index, options);
+  for (j = 0; j < g->len; j++)
+    loadstring(g->block2, j, g->block2, options);
+  count_inc(g->block2, g->len, options);
+  gen_render(g, options);
+}
+
+/* step to the next word.  There must be one */
+static void gen_advance(struct gen *g, const options_type *options) {
+size_t j, pos;
+
+  if (!finished(g->len, options) && (pos = increment(g->block2, g->len, options)) != NPOS) {
+    g->outlen = rerender_word(g->line, g->lineoff, pos, g->len, options);
+    g->stale = 0;
+    return;
+  }
+
+  /* on to the first word of the next length -d lets through */
+  do {
+    g->len++;
+    for (j = 0; j < g->len; j++)
+      loadstring(g->block2, j, NULL, options);
+    count_inc(g->block2, g->len, options);
+    make_valid(g->block2, g->len, options);
+  } while (g->len < options->max && too_many_duplicates(g->block2, g->len, options));
+  gen_render(g, options);
+}
+
+/* render the next count words into buf.  Returns the bytes used */
+static size_t gen_fill(struct gen *g, char *buf, unsigned long long count, const options_type *options) {
+size_t used = 0, n;
+
+  while (count > 0) {
+    if (g->stale)
+      gen_advance(g, options);
+    if (g->can_sweep && (n = sweep_word(&buf[used], (size_t)count*(g->outlen+1), g->block2, g->line, g->lineoff, g->len, options, count)) != 0) {
+      used += n*(g->outlen+1);
+      count -= n;
+      continue;
+    }
+    memcpy(&buf[used], g->line, g->outlen+1);
+    used += g->outlen+1;
+    count--;
+    g->stale = 1;
+  }
+  return used;
+}
+
+/* next piece of work for an idle worker, called with q->lock held.  A new
+   job if the writer isn't too far behind, else the back half of the
+   biggest piece still being rendered, looking at the oldest jobs first
+   since the writer waits on them.  NULL if there is nothing to do */
+static struct piece *take_piece(struct jobqueue *q) {
+struct job *jb, *vjob = NULL;
+struct piece *pc, *victim = NULL;
+unsigned long long t, left, mid;
+
+  if (q->next < q->njobs && q->next < q->written + q->nslots) {
+    t = q->next++;
+    jb = &q->slots[t % q->nslots];
+    pc = &jb->head;
+    pc->len = 0;
+    pc->first = pc->next = q->first + t*q->per_job;
+    pc->end = (t == q->njobs-1) ? q->first + q->total : pc->first + q->per_job;
+    pc->done = 0;
+    pc->after = NULL;
+    jb->pending = 1;
+    jb->state = 1;
+    return pc;
+  }
+
+  for (t = q->written; t < q->next && victim == NULL; t++) {
+    jb = &q->slots[t % q->nslots];
+    if (jb->state != 1)
+      continue;
+    left = 2*q->batch - 1;
+    for (pc = &jb->head; pc != NULL; pc = pc->after)
+      if (!pc->done && pc->end - pc->next > left) {
+        left = pc->end - pc->next;
+        victim = pc;
+        vjob = jb;
+      }
+  }
+  if (victim == NULL)
+    return NULL;
+
+  mid = victim->next + (victim->end - victim->next)/2;
+  pc = calloc(1, sizeof(struct piece));
+  if (pc != NULL)
+    pc->buf = malloc((size_t)(victim->end - mid)*q->linemax + SWEEP_SLACK);
+  if (pc == NULL || pc->buf == NULL) {
+    fprintf(stderr,"take_piece: can't allocate memory for piece\n");
+    exit(EXIT_FAILURE);
+  }
+  pc->first = pc->next = mid;
+  pc->end = victim->end;
+  pc->after = victim->after;
+  victim->end = mid;
+  victim->after = pc;
+  vjob->pending++;
+  return pc;
+}
+
+static void *job_worker(void *threadarg) {
+struct jobqueue *q = (struct jobqueue *)threadarg;
+struct job *jb;
+struct piece *pc;
+struct gen g;
+unsigned long long n;
+
+  g.line = malloc(gconvlen + SWEEP_SLACK);
+  if (g.line == NULL) {
+    fprintf(stderr,"job_worker: can't allocate memory for line\n");
+    exit(EXIT_FAILURE);
+  }
+
+  (void)pthread_mutex_lock(&q->lock);
+  while (!ctrlbreak) {
+    if ((pc = take_piece(q)) == NULL) {
+      if (q->next >= q->njobs)
+        break;
+      (void)pthread_cond_wait(&q->changed, &q->lock);
+      continue;
+    }
+    jb = &q->slots[((pc->first - q->first)/q->per_job) % q->nslots];
+    (void)pthread_mutex_unlock(&q->lock);
+
+    gen_seek(&g, pc->first, q->options);
+
+    (void)pthread_mutex_lock(&q->lock);
+    while (pc->next < pc->end && !ctrlbreak) {
+      n = pc->end - pc->next;
+      if (n > q->batch)
+        n = q->batch;
+      pc->next += n;
+      (void)pthread_mutex_unlock(&q->lock);
+
+      pc->len += gen_fill(&g, &pc->buf[pc->len], n, q->options);
+
+      (void)pthread_mutex_lock(&q->lock);
+    }
+    pc->done = 1;
+    if (--jb->pending == 0)
+      jb->state = 2;
+    (void)pthread_cond_broadcast(&q->changed);
+  }
+  (void)pthread_mutex_unlock(&q->lock);
+
+  free(g.line);
+  return NULL;
+}
+
+/* keyspace index of the word the jobs start at, startblock or else the
+   first of length start, and in total the words from there to the end */
+static unsigned long long job_first(size_t start, const wchar_t *startblock, const options_type *options, unsigned long long *total) {
+unsigned long long first;
+size_t k;
+
+  first = (startblock == NULL) ? 0 : rank_keyspace(startblock, start, options);
+  if (startblock == NULL)
+    for (k = options->min; k < start; k++)
+      first += count_words(k, options);
+  *total = count_keyspace(options) - first;
+  return first;
+}
+
+/* longest line of length end in bytes */
+static size_t job_linemax(size_t end) {
+  return end*MB_CUR_MAX + 1;
+}
+
+/* lines of linemax bytes that fit in bytes, at least one */
+static unsigned long long job_words(unsigned long long bytes, size_t linemax) {
+  return (bytes/linemax > 0) ? bytes/linemax : 1;
+}
+
+/* chunk() split over jobs threads.  The keyspace is cut into blocks of
+   consecutive words, workers render them into private buffers and the
+   writer below puts them out in order, so the output is the same as
+   chunk() gives.  Workers with nothing left to take steal the back half of
+   a block another worker is still on, see take_piece() */
+static void chunk_jobs(const size_t start, const size_t end, const wchar_t *startblock, const options_type options, const char *fpath, const char *outputfilename, const char *compressalgo, size_t jobs) {
+struct jobqueue q;
+struct job *jb;
+struct piece *pc, *after;
+pthread_t *workers;
+unsigned long long t;
+size_t k;
+
+  q.options = &options;
+  q.first = job_first(start, startblock, &options, &q.total);
+  if (q.total == 0)
+    return;
+
+  q.linemax = job_linemax(end);
+  q.per_job = job_words(JOB_BYTES, q.linemax);
+  q.batch = job_words(STEAL_BYTES, q.linemax);
+  q.njobs = (q.total - 1)/q.per_job + 1;
+  q.next = q.written = 0;
+  q.nslots = 2*jobs;
+
+  q.slots = calloc(q.nslots, sizeof(struct job));
+  workers = calloc(jobs, sizeof(pthread_t));
+  if (q.slots == NULL || workers == NULL) {
+    fprintf(stderr,"chunk_jobs: can't allocate memory for jobs\n");
+    exit(EXIT_FAILURE);
+  }
+  for (k = 0; k < q.nslots; k++) {
+    q.slots[k].head.buf = malloc(q.per_job*q.linemax + SWEEP_SLACK);
+    if (q.slots[k].head.buf == NULL) {
+      fprintf(stderr,"chunk_jobs: can't allocate memory for job buffer\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (outputfilename != NULL && out_open(fpath, 1, file_bytes(end)) != 0) { /* append to file */
+    fprintf(stderr,"chunk_jobs: File START could not be opened\n");
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  (void)pthread_mutex_init(&q.lock, NULL);
+  (void)pthread_cond_init(&q.changed, NULL);
+  for (k = 0; k < jobs; k++)
+    if (pthread_create(&workers[k], NULL, job_worker, &q) != 0) {
+      fprintf(stderr,"chunk_jobs: pthread_create failed\n");
+      exit(EXIT_FAILURE);
+    }
+
+  for (t = 0; t < q.njobs && !ctrlbreak; t++) {
+    jb = &q.slots[t % q.nslots];
+    (void)pthread_mutex_lock(&q.lock);
+    while (jb->state != 2)
+      (void)pthread_cond_wait(&q.changed, &q.lock);
+    (void)pthread_mutex_unlock(&q.lock);
+
+    for (pc = &jb->head; pc != NULL; pc = after) {
+      out_write(pc->buf, pc->len);
+      my_thread.bytecounter += pc->len;
+      my_thread.linecounter += pc->end - pc->first;
+      my_thread.linetotal += pc->end - pc->first;
+
+      after = pc->after;
+      if (pc != &jb->head) { /* split off by a thief */
+        free(pc->buf);
+        free(pc);
+      }
+    }
+
+    (void)pthread_mutex_lock(&q.lock);
+    jb->state = 0;
+    q.written++;
+    (void)pthread_cond_broadcast(&q.changed);
+    (void)pthread_mutex_unlock(&q.lock);
+  }
+
+  (void)pthread_mutex_lock(&q.lock);
+  q.next = q.njobs; /* hand out nothing more after ctrl-c */
+  (void)pthread_cond_broadcast(&q.changed);
+  (void)pthread_mutex_unlock(&q.lock);
+  for (k = 0; k < jobs; k++)
+    (void)pthread_join(workers[k], NULL);
+  (void)pthread_mutex_destroy(&q.lock);
+  (void)pthread_cond_destroy(&q.changed);
+
+  my_thread.bytetotal += my_thread.bytecounter;
+
+  if (outputfilename != NULL) {
+    if (out_close() != 0) {
+      fprintf(stderr,"chunk_jobs: close returned error number = %d\n", errno);
+      fprintf(stderr,"The problem is = %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if (!ctrlbreak)
+      renamefile(end, fpath, outputfilename, compressalgo);
+  }
+
+  for (k = 0; k < q.nslots; k++)
+    free(q.slots[k].head.buf);
+  free(q.slots);
+  free(workers);
+}
+
+/* write all of s to fd, which is file fpath.  Errors are fatal */
+static void split_write(int fd, const char *s, size_t n, const char *fpath) {
+ssize_t r;
+
+  while (n > 0) {
+    if ((r = write(fd, s, n)) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr,"crunch: write to %s failed = %d\n", fpath, errno);
+      fprintf(stderr,"The problem is = %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    s += r;
+    n -= (size_t)r;
+  }
+}
+
+/* make the -c file f.  Its name comes from its first and last words, which
+   are known before any of it is made.  Written as name.part and renamed
+   once complete, so a file with a finished name is always whole */
+static void split_file(struct splitqueue *q, struct splitfile *f, struct gen *g, char *buf, struct zblock *b) {
+const char *ext = (q->algo != 0) ? out_zext[q->algo] : "";
+unsigned long long left, n;
+size_t len;
+char *part;
+int fd;
+
+  gen_seek(g, f->first + f->words - 1, q->options);
+  f->lastword = malloc(g->outlen + 1);
+  gen_seek(g, f->first, q->options);
+  f->firstword = malloc(g->outlen + 1);
+  if (f->firstword == NULL || f->lastword == NULL) {
+    fprintf(stderr,"split_file: can't allocate memory for words\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(f->firstword, g->line, g->outlen);
+  f->firstword[g->outlen] = '\0';
+  gen_seek(g, f->first + f->words - 1, q->options);
+  memcpy(f->lastword, g->line, g->outlen);
+  f->lastword[g->outlen] = '\0';
+  gen_seek(g, f->first, q->options);
+
+  f->name = split_name(q->fpath, f->firstword, f->lastword, ext);
+  if ((part = malloc(strlen(f->name) + 6)) == NULL) {
+    fprintf(stderr,"split_file: can't allocate memory for the file name\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(part, f->name);
+  strcat(part, ".part");
+  if ((fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+    fprintf(stderr,"crunch: can't create %s\n", part);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  f->bytes = 0;
+  f->crc = 0;
+  for (left = f->words; left > 0 && !ctrlbreak; left -= n) {
+    n = (left < q->batch) ? left : q->batch;
+    len = gen_fill(g, buf, n, q->options);
+    if (manifest != NULL)
+      f->crc = crc_update(f->crc, buf, len);
+    f->bytes += len;
+    if (q->algo != 0) { /* each buffer a --zjobs block */
+      b->in = buf;
+      b->inlen = len;
+      out_zblock(q->algo, b);
+      split_write(fd, b->out, b->outlen, part);
+    }
+    else
+      split_write(fd, buf, len, part);
+  }
+
+  if (close(fd) != 0 || (!ctrlbreak && rename(part, f->name) != 0)) {
+    fprintf(stderr,"crunch: can't finish %s\n", f->name);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  free(part);
+}
+
+/* whether chunk() gets to the last word of a length, the one with every
+   position on its last char, rather than -d throwing it away */
+static int split_tail(size_t len, const options_type *options) {
+wchar_t *block;
+size_t pos;
+int ok;
+
+  if ((block = calloc(len+1, sizeof(wchar_t))) == NULL) {
+    fprintf(stderr,"split_tail: can't allocate memory for the word\n");
+    exit(EXIT_FAILURE);
+  }
+  for (pos = 0; pos < len; pos++)
+    if (options->pattern_info[pos].is_fixed)
+      block[pos] = options->pattern[pos];
+    else
+      block[pos] = options->pattern_info[pos].cset[options->pattern_info[pos].clen-1];
+  ok = !too_many_duplicates(block, len, options);
+  free(block);
+  return ok;
+}
+
+/* word just past the file starting at from.  chunk() checks -c and -b
+   before each word but writes the last word of a length, and the -e word,
+   after the check, so a full file still takes those */
+static unsigned long long split_end(const struct splitqueue *q, unsigned long long from) {
+const struct splitlen *s;
+unsigned long long lines = 0, bytes = 0, n, room;
+size_t k;
+
+  for (k = 0; k < q->nlens; k++) {
+    s = &q->lens[k];
+    if (s->end <= from)
+      continue;
+    n = s->end - from - s->tail; /* words the checks apply to */
+    if (n > 0) {
+      if (lines > linecount-1 || (bytecount > 0 && bytes > bytecount - s->outlen))
+        return from;
+      room = n-1; /* words after the first that fit as well */
+      if (room > linecount-1-lines)
+        room = linecount-1-lines;
+      if (bytecount > 0 && room > (bytecount - s->outlen - bytes)/(s->outlen+1))
+        room = (bytecount - s->outlen - bytes)/(s->outlen+1);
+      if (room < n-1)
+        return from + room+1;
+      from += n;
+      lines += n;
+      bytes += n*(s->outlen+1);
+    }
+    if (s->tail) {
+      from++;
+      lines++;
+      bytes += s->outlen+1;
+    }
+  }
+  return from;
+}
+
+static void *split_worker(void *threadarg) {
+struct splitqueue *q = (struct splitqueue *)threadarg;
+struct splitfile *f;
+struct zblock b;
+struct gen g;
+char *buf;
+
+  memset(&b, 0, sizeof(b));
+  g.line = malloc(gconvlen + SWEEP_SLACK);
+  buf = malloc((size_t)q->batch*q->linemax + SWEEP_SLACK);
+  if (g.line == NULL || buf == NULL) {
+    fprintf(stderr,"split_worker: can't allocate memory for buffers\n");
+    exit(EXIT_FAILURE);
+  }
+
+  (void)pthread_mutex_lock(&q->lock);
+  while (!ctrlbreak && q->next < q->nfiles) {
+    if (q->next >= q->written + q->nslots) { /* the manifest is behind */
+      (void)pthread_cond_wait(&q->changed, &q->lock);
+      continue;
     }
-    my_thread.bytecounter++;
+    f = &q->slots[q->next % q->nslots];
+    f->first = q->first + q->from;
+    f->words = split_end(q, q->from) - q->from;
+    q->from += f->words;
+    f->state = 1;
+    q->next++;
+    (void)pthread_mutex_unlock(&q->lock);
+
+    split_file(q, f, &g, buf, &b);
+
+    (void)pthread_mutex_lock(&q->lock);
+    f->state = 2;
+    (void)pthread_cond_broadcast(&q->changed);
   }
+  (void)pthread_mutex_unlock(&q->lock);
+
+  free(b.out);
+  free(buf);
+  free(g.line);
+  return NULL;
 }
 
-static void loadstring(wchar_t *block2, const size_t j, const wchar_t *startblock, const options_type options) {
+/* -c or -b with -j: every file's words are known in advance, so each
+   worker makes whole files of its own from its own starting point.  This
+   thread takes them in order for the manifest, the -z programs and the
+   percentage */
+static void chunk_split(const size_t start, const size_t end, const wchar_t *startblock, const options_type options, const char *fpath, const char *compressalgo, size_t jobs) {
+struct splitqueue q;
+struct splitfile *f;
+struct splitlen *s;
+pthread_t *workers;
+unsigned long long t, n;
+const char *ext;
+char *name;
 size_t k;
 
-  if (startblock == NULL) { /* is startblock null? */
-    if (options.pattern == NULL) { /* Yes so now test if pattern null? */
-      block2[j] = options.low_charset[0]; /* pattern is null so add character */
-      inc[j] = 0;
-    }
-    else { /* pattern is not null */
-      switch (options.pattern[j]) {
-        case L'@':
-          if (options.literalstring[j] != L'@') {
-            block2[j] = options.low_charset[0]; /* placeholder is set so add character */
-            inc[j] = 0;
-          }
-          else {
-           block2[j] = options.pattern[j]; /* add pattern letter to word */
-          }
-          break;
-        case L',':
-          if (options.literalstring[j] != L',') {
-            block2[j] = options.upp_charset[0]; /* placeholder is set so add character */
-            inc[j] = 0;
-          }
-          else {
-            block2[j] = options.pattern[j]; /* add pattern letter to word */
-          }
-          break;
-        case L'%':
-          if (options.literalstring[j] != L'%') {
-            block2[j] = options.num_charset[0]; /* placeholder is set so add character */
-            inc[j] = 0;
-          }
-          else {
-            block2[j] = options.pattern[j]; /* add pattern letter to word */
-          }
-          break;
-        case L'^':
-          if (options.literalstring[j] != L'^') {
-            block2[j] = options.sym_charset[0]; /* placeholder is set so add character */
-            inc[j] = 0;
-          }
-          else {
-            block2[j] = options.pattern[j]; /* add pattern letter to word */
-          }
-          break;
-        default:
-          block2[j] = options.pattern[j]; /* add pattern letter to word */
-        }
-      }
+  q.options = &options;
+  q.first = job_first(start, startblock, &options, &q.total);
+  if (q.total == 0)
+    return;
+
+  q.linemax = job_linemax(end);
+  q.batch = job_words(out.size, q.linemax); /* --buffer, and the -z block size */
+  if (bytecount > 0 && options.uniform_width == 0) {
+    fprintf(stderr,"-j with -b needs every word of a length to take the same number of bytes, which the charsets used don't give\n");
+    exit(EXIT_FAILURE);
+  }
+  if ((q.lens = calloc(end - options.min + 1, sizeof(struct splitlen))) == NULL) {
+    fprintf(stderr,"chunk_split: can't allocate memory for the split\n");
+    exit(EXIT_FAILURE);
+  }
+  q.nlens = 0;
+  n = (options.startstring == NULL) ? 0 : rank_word(options.startstring, options.min, &options);
+  for (k = options.min, t = 0; k <= end && (q.nlens == 0 || q.lens[q.nlens-1].end < q.total); k++) {
+    t = add_sat(t, count_words(k, &options));
+    if (t <= n + q.first)
+      continue;
+    s = &q.lens[q.nlens++];
+    s->end = t - n - q.first;
+    s->outlen = options.uniform_width ? line_bytes(k, &options)-1 : 0;
+    s->tail = split_tail(k, &options);
+    if (s->end > q.total) { /* cut short by -e */
+      s->end = q.total;
+      s->tail = !too_many_duplicates(options.endstring, end, &options);
     }
-  else { /* startblock is not null */
-    if (options.pattern == NULL) { /* Yes so now test if pattern null? */
-      block2[j] = startblock[j]; /* pattern is null so add character */
-      for(k = 0; k < wcslen(options.low_charset); k++) {
-        if (block2[j] == options.low_charset[k]) {
-          inc[j] = k;
-        }
-      }
+  }
+  for (q.from = 0, q.nfiles = 0; q.from < q.total; q.nfiles++)
+    q.from = split_end(&q, q.from);
+  q.from = 0;
+  q.next = q.written = 0;
+  q.nslots = 2*jobs;
+  q.fpath = fpath;
+  q.algo = (out.z != NULL) ? out.z->algo : 0;
+
+  q.slots = calloc(q.nslots, sizeof(struct splitfile));
+  workers = calloc(jobs, sizeof(pthread_t));
+  if (q.slots == NULL || workers == NULL) {
+    fprintf(stderr,"chunk_split: can't allocate memory for jobs\n");
+    exit(EXIT_FAILURE);
+  }
+
+  (void)pthread_mutex_init(&q.lock, NULL);
+  (void)pthread_cond_init(&q.changed, NULL);
+  for (k = 0; k < jobs; k++)
+    if (pthread_create(&workers[k], NULL, split_worker, &q) != 0) {
+      fprintf(stderr,"chunk_split: pthread_create failed\n");
+      exit(EXIT_FAILURE);
     }
-    else {
-      switch (options.pattern[j]) {
-        case L'@':
-          if (options.literalstring[j] != L'@') {
-            block2[j] = startblock[j]; /* pattern is null so add character */
-            for(k = 0; k < wcslen(options.low_charset); k++)
-              if (block2[j] == options.low_charset[k])
-                inc[j] = k;
-          }
-          else {
-            block2[j] = options.pattern[j]; /* add pattern letter to word */
-          }
-        break;
-        case L',':
-          if (options.literalstring[j] != L',') {
-            block2[j] = startblock[j]; /* pattern is null so add character */
-            for(k = 0; k < wcslen(options.upp_charset); k++)
-              if (block2[j] == options.upp_charset[k])
-                inc[j] = k;
-          }
-          else {
-            block2[j] = options.pattern[j]; /* add pattern letter to word */
-          }
-        break;
-        case L'%':
-          if (options.literalstring[j] != L'%') {
-            block2[j] = startblock[j]; /* pattern is null so add character */
-            for(k = 0; k < wcslen(options.num_charset); k++)
-              if (block2[j] == options.num_charset[k])
-                inc[j] = k;
-          }
-          else {
-            block2[j] = options.pattern[j]; /* add pattern letter to word */
-          }
-        break;
-        case L'^':
-          if (options.literalstring[j] != L'^') {
-            block2[j] = startblock[j]; /* pattern is null so add character */
-            for(k = 0; k < wcslen(options.sym_charset); k++)
-              if (block2[j] == options.sym_charset[k])
-                inc[j] = k;
-          }
-          else {
-            block2[j] = options.pattern[j]; /* add pattern letter to word */
-          }
-        break;
-        default:
-          block2[j] = options.pattern[j]; /* add pattern letter to word */
+
+  for (t = 0; t < q.nfiles && !ctrlbreak; t++) {
+    f = &q.slots[t % q.nslots];
+    (void)pthread_mutex_lock(&q.lock);
+    while (f->state != 2 && !(ctrlbreak && f->state == 0))
+      (void)pthread_cond_wait(&q.changed, &q.lock);
+    (void)pthread_mutex_unlock(&q.lock);
+    if (f->state != 2 || ctrlbreak)
+      break;
+
+    my_thread.linetotal += f->words;
+    my_thread.bytetotal += f->bytes;
+    fprintf(stderr,"\ncrunch: %3d%% completed generating output\n", (int)(100L * my_thread.linetotal / my_thread.finallinecount));
+    if (manifest != NULL) {
+      ext = (compressalgo != NULL && q.algo == 0) ? zprog_ext(compressalgo) : "";
+      if ((name = malloc(strlen(f->name) + strlen(ext) + 1)) == NULL) {
+        fprintf(stderr,"chunk_split: can't allocate memory for the file name\n");
+        exit(EXIT_FAILURE);
       }
+      strcpy(name, f->name);
+      strcat(name, ext);
+      manifest_add(name, f->bytes, f->words, f->crc, f->first, f->firstword, f->lastword);
+      free(name);
     }
+    if (compressalgo != NULL && q.algo == 0)
+      zprog_start(f->name, compressalgo);
+
+    free(f->name);
+    free(f->firstword);
+    free(f->lastword);
+    f->name = f->firstword = f->lastword = NULL;
+    (void)pthread_mutex_lock(&q.lock);
+    f->state = 0;
+    q.written++;
+    (void)pthread_cond_broadcast(&q.changed);
+    (void)pthread_mutex_unlock(&q.lock);
   }
+
+  (void)pthread_mutex_lock(&q.lock);
+  q.next = q.nfiles;
+  (void)pthread_cond_broadcast(&q.changed);
+  (void)pthread_mutex_unlock(&q.lock);
+  for (k = 0; k < jobs; k++)
+    (void)pthread_join(workers[k], NULL);
+  (void)pthread_cond_destroy(&q.changed);
+  (void)pthread_mutex_destroy(&q.lock);
+  for (k = 0; k < q.nslots; k++) {
+    free(q.slots[k].name);
+    free(q.slots[k].firstword);
+    free(q.slots[k].lastword);
+  }
+  free(q.slots);
+  free(q.lens);
+  free(workers);
 }
 
-static void chunk(const size_t start, const size_t end, const wchar_t *startblock, const options_type options, const char *fpath, const char *outputfilename, const char *compressalgo) {
-size_t i,j;      /* loop counters */
-wchar_t *block2;      /* block is word being created */
-size_t outlen; /* temp for size of narrow output string */
+/* write all of s to fd at offset at, fd being file fpath.  Errors are fatal */
+static void pwrite_all(int fd, const char *s, size_t n, unsigned long long at, const char *fpath) {
+ssize_t r;
 
-  errno = 0;
-  block2 = calloc(end+1,sizeof(wchar_t)); /* block can't be bigger than max size */
-  if (block2 == NULL) {
-    fprintf(stderr,"chunk: can't allocate memory for block2\n");
+  while (n > 0) {
+    if ((r = pwrite(fd, s, n, (off_t)at)) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr,"crunch: write to %s failed = %d\n", fpath, errno);
+      fprintf(stderr,"The problem is = %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    s += r;
+    n -= (size_t)r;
+    at += (unsigned long long)r;
+  }
+}
+
+static void *pwrite_worker(void *threadarg) {
+struct pwritequeue *q = (struct pwritequeue *)threadarg;
+unsigned long long t, left, n, at;
+struct gen g;
+size_t len;
+char *buf;
+
+  g.line = malloc(gconvlen + SWEEP_SLACK);
+  buf = malloc((size_t)q->batch*q->linemax + SWEEP_SLACK);
+  if (g.line == NULL || buf == NULL) {
+    fprintf(stderr,"pwrite_worker: can't allocate memory for buffers\n");
     exit(EXIT_FAILURE);
   }
 
-  for (i = start; (i <= end) && !ctrlbreak; i++) {
-    for (j = 0; j < i; j++) {
-      loadstring(block2, j, startblock, options);
+  (void)pthread_mutex_lock(&q->lock);
+  while (!ctrlbreak && q->next < q->njobs) {
+    if (q->next >= q->written + q->nslots) { /* don't get too far ahead of ctrl-c's cut */
+      (void)pthread_cond_wait(&q->changed, &q->lock);
+      continue;
     }
-    startblock = NULL;
-
-    if (outputfilename == NULL) { /* user wants to display words on screen */
-      if (options.endstring == NULL) {
-        while ((!finished(block2,options) && !ctrlbreak) && (my_thread.linecounter < (linecount-1))) {
-          if (!too_many_duplicates(block2, options)) {
-            (void)make_narrow_string(gconvbuffer,block2,gconvlen);
-            fprintf(fptr, "%s\n", gconvbuffer);
-            my_thread.linecounter++;
-          }
-          increment(block2, options);
-        }
-        if (!too_many_duplicates(block2, options)) { /*flush last word */
-          (void)make_narrow_string(gconvbuffer,block2,gconvlen);
-          fprintf(fptr, "%s\n", gconvbuffer);
-        }
-        if (my_thread.linecounter == (linecount-1)) {
-          goto killloop;
-        }
-      }
-      else {
-        while (!finished(block2,options) && !ctrlbreak && (wcsncmp(block2,options.endstring,wcslen(options.endstring)) != 0) ) {
-          if (!too_many_duplicates(block2, options)) {
-            (void)make_narrow_string(gconvbuffer,block2,gconvlen);
-            fprintf(fptr, "%s\n", gconvbuffer);
-            my_thread.linecounter++;
-          }
-          increment(block2, options);
-        }
-        if (!too_many_duplicates(block2, options)) { /*flush last word */
-          (void)make_narrow_string(gconvbuffer,block2,gconvlen);
-          fprintf(fptr, "%s\n", gconvbuffer);
-        }
-        if (wcsncmp(block2,options.endstring,wcslen(options.endstring)) == 0)
-          break;
-      }
+    t = q->next++;
+    q->state[t % q->nslots] = 1;
+    (void)pthread_mutex_unlock(&q->lock);
+
+    left = (t == q->njobs-1) ? q->total - t*q->per_job : q->per_job;
+    at = q->base + keyspace_bytes(q->first + t*q->per_job, q->options) - q->skip;
+    gen_seek(&g, q->first + t*q->per_job, q->options);
+    for (; left > 0 && !ctrlbreak; left -= n) {
+      n = (left < q->batch) ? left : q->batch;
+      len = gen_fill(&g, buf, n, q->options);
+      pwrite_all(q->fd, buf, len, at, q->fpath);
+      at += len;
     }
-    else { /* user wants to generate a file */
-      if ((fptr = fopen(fpath,"a+")) == NULL) { /* append to file */
-        fprintf(stderr,"chunk1: File START could not be opened\n");
-        fprintf(stderr,"The problem is = %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-      }
-      else { /* file opened start writing.  file will be renamed when done */
-        while (!finished(block2, options) && (ferror(fptr) == 0) && !ctrlbreak) {
-          if ((options.endstring != NULL) && (wcsncmp(block2,options.endstring,wcslen(options.endstring)) == 0))
-            break;
 
-          outlen = make_narrow_string(gconvbuffer,block2,gconvlen);
+    (void)pthread_mutex_lock(&q->lock);
+    q->state[t % q->nslots] = 2;
+    (void)pthread_cond_broadcast(&q->changed);
+  }
+  (void)pthread_mutex_unlock(&q->lock);
 
-          if ((my_thread.linecounter <= (linecount-1)) && (my_thread.bytecounter <= (bytecount - outlen))) { /* not time to create a new file */
-            if (!too_many_duplicates(block2, options)) {
-              fprintf(fptr, "%s\n", gconvbuffer);
-              if (ferror(fptr) != 0) {
-                fprintf(stderr,"chunk1: fprintf failed = %d\n", errno);
-                fprintf(stderr,"The problem is = %s\n", strerror(errno));
-                free(block2);
-                exit(EXIT_FAILURE);
-              }
-              my_thread.bytecounter += (unsigned long long)outlen+1;
-              my_thread.linecounter++;
-              my_thread.linetotal++;
-            }
-            increment(block2,options);
-          }
-          else { /* time to create a new file */
-            my_thread.bytetotal+=my_thread.bytecounter;
+  free(buf);
+  free(g.line);
+  return NULL;
+}
 
-            if (fclose(fptr) != 0) {
-              fprintf(stderr,"chunk1: fclose returned error number = %d\n",errno);
-              fprintf(stderr,"The problem is = %s\n", strerror(errno));
-              free(block2);
-              exit(EXIT_FAILURE);
-            }
-            renamefile(end, fpath, outputfilename, compressalgo);
+/* --pwrite: chunk_jobs() without the writer.  When every line of a length
+   has the same number of bytes, where each word goes in the file is known
+   from the counts alone, so workers write their blocks straight into the
+   file with pwrite.  This thread only follows the finished blocks in order
+   for the percentage, and on ctrl-c cuts the file back to the last block
+   that has everything before it, so -r carries on from there */
+static void chunk_pwrite(const size_t start, const size_t end, const wchar_t *startblock, const options_type options, const char *fpath, const char *outputfilename, size_t jobs) {
+struct pwritequeue q;
+struct gen g;
+struct stat st;
+pthread_t *workers;
+unsigned long long t, n, done = 0, bytes = 0;
+size_t k;
+int err;
 
-            if ((options.endstring == NULL) || (wcsncmp(block2,options.endstring,wcslen(options.endstring)) != 0)) {
-              if ((fptr = fopen(fpath, "w")) == NULL) {
-                fprintf(stderr,"chunk2: Ouput file START could not be opened\n");
-                free(block2);
-                exit(EXIT_FAILURE);
-              }
-              my_thread.linecounter = 0;
-              my_thread.bytecounter = 0;
-            }
-            else {
-              goto killloop;
-            }
-          }
-        }
+  if (options.uniform_width == 0) {
+    fprintf(stderr,"--pwrite needs every word of a length to take the same number of bytes, which the charsets used don't give\n");
+    exit(EXIT_FAILURE);
+  }
 
-        if (fptr == NULL) {
-          fprintf(stderr,"chunk: something really bad happened\n");
-          exit(EXIT_FAILURE);
-        }
-        else {
-          if (!too_many_duplicates(block2, options)) {
+  q.options = &options;
+  q.first = job_first(start, startblock, &options, &q.total);
+  if (q.total == 0)
+    return;
 
-            outlen = make_narrow_string(gconvbuffer,block2,gconvlen);
-            fprintf(fptr, "%s\n", gconvbuffer); /* flush the last word */
+  q.linemax = job_linemax(end);
+  q.per_job = job_words(JOB_BYTES, q.linemax);
+  q.batch = job_words(out.size, q.linemax);
+  if (q.batch > q.per_job)
+    q.batch = q.per_job;
+  q.njobs = (q.total - 1)/q.per_job + 1;
+  q.next = q.written = 0;
+  q.nslots = 4*jobs;
+  q.skip = keyspace_bytes(q.first, &options);
+  q.fpath = fpath;
+
+  q.state = calloc(q.nslots, sizeof(int));
+  workers = calloc(jobs, sizeof(pthread_t));
+  g.line = malloc(gconvlen + SWEEP_SLACK);
+  if (q.state == NULL || workers == NULL || g.line == NULL) {
+    fprintf(stderr,"chunk_pwrite: can't allocate memory for jobs\n");
+    exit(EXIT_FAILURE);
+  }
 
-            my_thread.linecounter++;
-            my_thread.linetotal++;
-            my_thread.bytecounter += (unsigned long long)outlen+1;
+  /* the words go after whatever -r found, into space taken up front */
+  if ((q.fd = open(fpath, O_WRONLY | O_CREAT, 0666)) < 0 || fstat(q.fd, &st) != 0) {
+    fprintf(stderr,"chunk_pwrite: File START could not be opened\n");
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  q.base = (unsigned long long)st.st_size;
+  if ((err = posix_fallocate(q.fd, (off_t)q.base, (off_t)(keyspace_bytes(q.first + q.total, &options) - q.skip))) != 0) {
+    fprintf(stderr,"chunk_pwrite: can't allocate space for %s\n", fpath);
+    fprintf(stderr,"The problem is = %s\n", strerror(err));
+    exit(EXIT_FAILURE);
+  }
 
-            if (ferror(fptr) != 0) {
-              fprintf(stderr,"chunk2: fprintf failed = %d\n", errno);
-              fprintf(stderr,"The problem is = %s\n", strerror(errno));
-              free(block2);
-              exit(EXIT_FAILURE);
-            }
-          }
-          if (fclose(fptr) != 0) {
-            fprintf(stderr,"chunk2: fclose returned error number = %d\n", errno);
-            fprintf(stderr,"The problem is = %s\n", strerror(errno));
-            free(block2);
-            exit(EXIT_FAILURE);
-          }
+  (void)pthread_mutex_init(&q.lock, NULL);
+  (void)pthread_cond_init(&q.changed, NULL);
+  for (k = 0; k < jobs; k++)
+    if (pthread_create(&workers[k], NULL, pwrite_worker, &q) != 0) {
+      fprintf(stderr,"chunk_pwrite: pthread_create failed\n");
+      exit(EXIT_FAILURE);
+    }
 
-          if ((options.endstring != NULL) && (wcsncmp(block2,options.endstring,wcslen(options.endstring)) == 0))
-            break;
+  for (t = 0; t < q.njobs && !ctrlbreak; t++) {
+    (void)pthread_mutex_lock(&q.lock);
+    while (q.state[t % q.nslots] != 2 && !(ctrlbreak && q.state[t % q.nslots] == 0))
+      (void)pthread_cond_wait(&q.changed, &q.lock);
+    (void)pthread_mutex_unlock(&q.lock);
+    if (q.state[t % q.nslots] != 2 || ctrlbreak)
+      break;
 
-          if (ctrlbreak == 1)
-            break;
-        }
-      } /* else from if fopen */
-    } /* else from outputfilename == NULL */
-  } /* for start < end loop */
+    n = (t == q.njobs-1) ? q.total - t*q.per_job : q.per_job;
+    my_thread.bytecounter -= bytes;
+    bytes = keyspace_bytes(q.first + t*q.per_job + n, &options) - q.skip;
+    my_thread.bytecounter += bytes;
+    my_thread.linecounter += n;
+    my_thread.linetotal += n;
+    done += n;
+
+    (void)pthread_mutex_lock(&q.lock);
+    q.state[t % q.nslots] = 0;
+    q.written++;
+    (void)pthread_cond_broadcast(&q.changed);
+    (void)pthread_mutex_unlock(&q.lock);
+  }
 
-  if (ctrlbreak == 1 ) {
-    (void)make_narrow_string(gconvbuffer,block2,gconvlen);
-    fprintf(stderr,"Crunch ending at %s\n",gconvbuffer);
+  (void)pthread_mutex_lock(&q.lock);
+  q.next = q.njobs; /* hand out nothing more after ctrl-c */
+  (void)pthread_cond_broadcast(&q.changed);
+  (void)pthread_mutex_unlock(&q.lock);
+  for (k = 0; k < jobs; k++)
+    (void)pthread_join(workers[k], NULL);
+  (void)pthread_mutex_destroy(&q.lock);
+  (void)pthread_cond_destroy(&q.changed);
+
+  if (done < q.total && ftruncate(q.fd, (off_t)(q.base + bytes)) != 0) {
+    fprintf(stderr,"chunk_pwrite: can't cut %s back after ctrl-c\n", fpath);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (close(q.fd) != 0) {
+    fprintf(stderr,"chunk_pwrite: close returned error number = %d\n", errno);
+    fprintf(stderr,"The problem is = %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
   }
 
-  killloop:
+  if (done > 0) { /* for renamefile, which names START after its ends */
+    gen_seek(&g, q.first, &options);
+    out_ends(g.line, g.outlen+1);
+    gen_seek(&g, q.first + done - 1, &options);
+    out_ends(g.line, g.outlen+1);
+  }
+  out.filebytes += bytes;
   my_thread.bytetotal += my_thread.bytecounter;
 
-  if ((outputfilename != NULL) && !ctrlbreak) {
-    renamefile(end, fpath, outputfilename, compressalgo);
-  }
+  if (outputfilename != NULL && !ctrlbreak)
+    renamefile(end, fpath, outputfilename, NULL);
 
-  free(block2);
+  free(g.line);
+  free(q.state);
+  free(workers);
 }
 
 static void usage() {
@@ -1838,48 +4815,270 @@ static void usage() {
   fprintf(stderr,"Please refer to the man page for instructions and examples on how to use crunch.\n");
 }
 
-static wchar_t *resumesession(const char *fpath, const wchar_t *charset) {
+/* START.ckpt, where crunch notes how far START got */
+static char *checkpoint_name(const char *fpath) {
+char *name;
+
+  if ((name = malloc(strlen(fpath) + 6)) == NULL) {
+    fprintf(stderr,"checkpoint: can't allocate memory for the file name\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(name, fpath);
+  strcat(name, ".ckpt");
+  return name;
+}
+
+/* bytes at the end of what has been written that are not a whole line yet */
+static size_t out_torn(void) {
+size_t k = out.taillen;
+
+  while (k > 0 && out.tail[k-1] != '\n')
+    k--;
+  return out.taillen - k;
+}
+
+/* --checkpoint, after each write.  Once checkpoint_ms has gone by bring
+   START.ckpt up to date, so a power cut loses at most that much */
+static void out_checkpoint(void) {
+struct timespec now;
+
+  if (checkpoint_fpath == NULL)
+    return;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  if ((now.tv_sec - checkpoint_last.tv_sec)*1000L + (now.tv_nsec - checkpoint_last.tv_nsec)/1000000L < checkpoint_ms)
+    return;
+  checkpoint_last = now;
+  checkpoint_write(checkpoint_fpath, checkpoint_options);
+}
+
+/* note in START.ckpt where START got to: the number of its last whole word,
+   the offset just past it, how many words come before that and, with
+   --manifest, their CRC-32, so -r can carry on without reading START
+   through.  START is synced first and START.ckpt replaced in one rename, so
+   after a crash START.ckpt never points past what is on disk */
+static void checkpoint_write(const char *fpath, const options_type *options) {
+char first[OUT_ENDS], last[OUT_ENDS];
+unsigned long long rank, words;
+size_t torn = out_torn();
+wchar_t *word;
+char *name, *tmp;
+FILE *fp;
+int fd, ret = -1;
+
+  out_end(first, sizeof(first), 0);
+  out_end(last, sizeof(last), 1);
+  first[strcspn(first, "\n")] = '\0';
+  last[strcspn(last, "\n")] = '\0';
+  if (options->startstring != NULL || last[0] == '\0') /* -r can't be used with -s */
+    return;
+
+  word = alloc_wide_string(last, NULL);
+  rank = rank_keyspace(word, wcslen(word), options);
+  free(word);
+  word = alloc_wide_string(first, NULL);
+  words = rank - rank_keyspace(word, wcslen(word), options) + 1;
+  free(word);
+
+  name = checkpoint_name(fpath);
+  if ((tmp = malloc(strlen(name) + 5)) == NULL) {
+    fprintf(stderr,"checkpoint: can't allocate memory for the file name\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(tmp, name);
+  strcat(tmp, ".tmp");
+
+  if ((fd = open(fpath, O_WRONLY)) >= 0) { /* the words before the note */
+    ret = fdatasync(fd);
+    (void)close(fd);
+  }
+  if (ret == 0 && (fp = fopen(tmp, "w")) != NULL) {
+    ret = fprintf(fp, "rank %llu\nbytes %llu\nwords %llu\n", rank, out.filebytes - torn, words);
+    if (ret >= 0)
+      ret = (manifest != NULL && torn == 0) ? fprintf(fp, "crc %08lx\n", out.crc) : fprintf(fp, "crc -\n");
+    if (ret >= 0)
+      ret = (fflush(fp) == 0 && fsync(fileno(fp)) == 0) ? 0 : -1;
+    if (fclose(fp) != 0)
+      ret = -1;
+    if (ret == 0)
+      ret = rename(tmp, name);
+  }
+  else
+    ret = -1;
+  if (ret == 0) { /* and the rename */
+    strcpy(tmp, fpath);
+    strcpy(&tmp[strlen(tmp) - 5], ".");
+    if ((fd = open(tmp, O_RDONLY)) >= 0) {
+      (void)fsync(fd);
+      (void)close(fd);
+    }
+  }
+  else {
+    fprintf(stderr,"crunch: can't write %s, -r will read START through\n", name);
+    strcat(strcpy(tmp, name), ".tmp");
+    (void)remove(tmp);
+  }
+  free(tmp);
+  free(name);
+}
+
+/* put the first and last bytes of START's first end bytes in out's ends,
+   the first line in first and the last whole one in line.  -1 if it holds
+   no whole line */
+static int resume_ends(int fd, unsigned long long end, char *first, size_t fsize, char *line, size_t lsize) {
+char head[OUT_ENDS], tail[OUT_ENDS];
+size_t n, m;
+
+  out.headlen = out.taillen = 0;
+  n = (end < OUT_ENDS) ? (size_t)end : OUT_ENDS;
+  m = (end - n < OUT_ENDS) ? (size_t)(end - n) : OUT_ENDS;
+  if (pread(fd, head, n, 0) != (ssize_t)n || pread(fd, tail, m, (off_t)(end - m)) != (ssize_t)m)
+    return -1;
+  out_ends(head, n);
+  out_ends(tail, m);
+  out_end(first, fsize, 0);
+  out_end(line, lsize, 1);
+  first[strcspn(first, "\n")] = '\0';
+  return (line[0] == '\0') ? -1 : 0;
+}
+
+/* -r without reading START through.  Its first and last lines come from
+   either end of the file and the number of words between them from their
+   numbers.  START.ckpt, if it matches the file, gives the last word's
+   number and the CRC-32 --manifest needs.  Whatever follows the checkpoint,
+   or without one a torn last line, is what a crash left half written and
+   is cut off.  Leaves the last line in line.  NULL if START has to be read
+   after all */
+static wchar_t *resume_fast(const char *fpath, const options_type *options, char *line, size_t size) {
+char first[OUT_ENDS], crc[16] = "-";
+unsigned long long rank = 0, bytes = 0, words = 0, end;
+wchar_t *word = NULL, *startblock = NULL;
+struct stat st;
+char *name;
+FILE *fp;
+int fd, ok = 0;
+
+  if ((fd = open(fpath, O_RDWR)) < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    (void)close(fd);
+    return NULL;
+  }
+
+  name = checkpoint_name(fpath);
+  if ((fp = fopen(name, "r")) != NULL) {
+    ok = (fscanf(fp, "rank %llu bytes %llu words %llu crc %15s", &rank, &bytes, &words, crc) == 4 && bytes > 0 && bytes <= (unsigned long long)st.st_size);
+    (void)fclose(fp);
+  }
+  free(name);
+
+  if (ok && resume_ends(fd, bytes, first, sizeof(first), line, size) == 0) {
+    word = alloc_wide_string(line, NULL);
+    word[wcscspn(word, L"\n")] = L'\0';
+    startblock = calloc(options->max+1, sizeof(wchar_t));
+    if (startblock == NULL) {
+      fprintf(stderr,"resume: can't allocate memory for startblock\n");
+      exit(EXIT_FAILURE);
+    }
+    if (unrank_keyspace(startblock, rank, options) == 0 || wcscmp(startblock, word) != 0) {
+      free(startblock); /* START.ckpt is for some other START */
+      free(word);
+      startblock = word = NULL;
+    }
+  }
+
+  if (startblock != NULL) { /* the word straight from its number */
+    free(word);
+    end = bytes;
+  }
+  else {
+    strcpy(crc, "-");
+    end = (unsigned long long)st.st_size;
+    if (resume_ends(fd, end, first, sizeof(first), line, size) == 0 && out_torn() > 0) {
+      end -= out_torn();
+      (void)resume_ends(fd, end, first, sizeof(first), line, size);
+    }
+    if (line[0] == '\0') { /* not one whole line */
+      (void)close(fd);
+      out.headlen = out.taillen = 0;
+      return NULL;
+    }
+    startblock = alloc_wide_string(line, NULL);
+    startblock[wcscspn(startblock, L"\n")] = L'\0';
+    word = alloc_wide_string(first, NULL);
+    words = rank_keyspace(startblock, wcslen(startblock), options) - rank_keyspace(word, wcslen(word), options) + 1;
+    free(word);
+  }
+
+  if (end < (unsigned long long)st.st_size) {
+    fprintf(stderr,"resume: START has %llu bytes after the last word known to be whole, cutting them off\n", (unsigned long long)st.st_size - end);
+    if (ftruncate(fd, (off_t)end) != 0) {
+      fprintf(stderr,"resume: can't cut START back\n");
+      fprintf(stderr,"The problem is = %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  (void)close(fd);
+
+  if (manifest != NULL && crc[0] == '-') { /* nothing to take the CRC from */
+    free(startblock);
+    out.headlen = out.taillen = 0;
+    return NULL;
+  }
+  out.filebytes = end;
+  out.filewords = words;
+  out.crc = strtoul(crc, NULL, 16);
+  my_thread.bytecounter += end;
+  my_thread.linecounter += words;
+  return startblock;
+}
+
+static wchar_t *resumesession(const char *fpath, const options_type *options) {
 FILE *optr;     /* ptr to START output file; will be renamed later */
 char buff[512]; /* buffer to hold line from wordlist */
-wchar_t *startblock;
-size_t j, k;
+wchar_t *startblock = NULL;
+size_t j;
 
   errno = 0;
   memset(buff, 0, sizeof(buff));
 
-  if ((optr = fopen(fpath,"r")) == NULL) {
+  if (out.z != NULL) /* -z, START is compressed */
+    out_zresume(fpath, buff, sizeof(buff));
+  else if ((startblock = resume_fast(fpath, options, buff, sizeof(buff))) != NULL)
+    ;
+  else if ((optr = fopen(fpath,"r")) == NULL) {
     fprintf(stderr,"resume: File START could not be opened\n");
     exit(EXIT_FAILURE);
   }
   else {  /* file opened above now read first line */
     while (feof(optr) == 0) {
-      (void)fgets(buff, (int)sizeof(buff), optr);
-      ++my_thread.linecounter;
+      if (fgets(buff, (int)sizeof(buff), optr) != NULL)
+        out_sum(buff, strlen(buff)); /* for renamefile */
+      if (my_thread.linecounter++ == 0)
+        out_ends(buff, strlen(buff));
       my_thread.bytecounter += (unsigned long long)strlen(buff);
     } /* all of this just to get last line */
     my_thread.linecounter--; /* -1 to get correct num */
     my_thread.bytecounter -= (unsigned long long)strlen(buff);
+    out_ends(buff, strlen(buff));
 
     if (fclose(optr) != 0) {
       fprintf(stderr,"resume: fclose returned error number = %d\n", errno);
       fprintf(stderr,"The problem is = %s\n", strerror(errno));
       exit(EXIT_FAILURE);
     }
+  }
 
-    if (buff[0])
-      buff[strlen(buff)-1]='\0';
+  if (buff[0])
+    buff[strcspn(buff, "\n")]='\0';
 
+  if (startblock == NULL)
     startblock = alloc_wide_string(buff,NULL);
 
-    fprintf(stderr,"Resuming from = %s\n", buff);
+  fprintf(stderr,"Resuming from = %s\n", buff);
 
-    for (j = 0; j < wcslen(startblock); j++) {
-      for(k = 0; k < wcslen(charset); k++)
-        if (startblock[j] == charset[k])
-          inc[j] = k;
-    }
-    return startblock;
-  }
+  for (j = 0; j < wcslen(startblock); j++)
+    loadstring(startblock, j, startblock, options);
+  return startblock;
 }
 
 /*@null@*/ static wchar_t *readcharsetfile(const char *charfilename, const char *charsetname, int* r_is_unicode) {
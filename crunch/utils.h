@@ -1,3 +1,7 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* vmsplice and F_SETPIPE_SZ */
+#endif
+
 #include <assert.h>
 #include <locale.h>
 #include <stdint.h>
@@ -12,8 +16,49 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#if defined(__linux__) && defined(F_SETPIPE_SZ) && defined(SPLICE_F_GIFT)
+#define HAVE_VMSPLICE 1 /* --vmsplice */
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_URING 1 /* --uring, spoken to through raw syscalls */
+#endif
+#endif
+
+/* -z libraries.  The Makefile defines HAVE_ZLIB and friends for the ones
+   it finds; -z with a library missing runs the program of that name */
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BZLIB
+#include <bzlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_SWEEP_SIMD 1 /* sse4.2/avx2 sweep kernels, picked at runtime */
+#endif
 
 /* largest output string */
 #define MAXSTRING 128
@@ -23,13 +68,60 @@
 /* invalid index for size_t's */
 #define NPOS ((size_t)-1)
 
+/* bytes a sweep kernel may write past the last line */
+#define SWEEP_SLACK 32
+
+/* largest block of -i words sweep_tile writes at once */
+#define TILE_BYTES 65536
+
+/* default size of the output buffer, --buffer */
+#define OUT_BYTES 4194304
+/* words written between looks at the clock for --flush */
+#define OUT_TICKS 256
+/* --vmsplice: buffers taking turns, each half the pipe.  See out_flush */
+#define OUT_SLOTS 3
+/* --vmsplice: smallest buffer worth it.  Also the floor for --uring, and
+   keeps sweep_room() from ever needing more than a fixed buffer holds */
+#define OUT_MIN_SPLICE 262144
+
+/* --uring: output buffers, one being filled while the others are written */
+#define OUT_URING_BUFS 4
+
+/* --mmap: bytes of the output file mapped at a time */
+#define OUT_MAP_BYTES 67108864
+
+/* --direct: O_DIRECT writes are whole blocks of this many bytes from a
+   buffer aligned to it, which suits every disk in use */
+#define OUT_DIRECT_ALIGN 4096
+#ifndef O_DIRECT
+#define O_DIRECT 0 /* no such flag, --direct only keeps the writes aligned */
+#endif
+
+/* -z: compressed bytes collected before they are written */
+#define OUT_Z_BYTES 262144
+/* -z zstd and lz4 levels, for the stream and the --zjobs blocks alike.
+   The libraries' defaults: ZSTD_CLEVEL_DEFAULT, and lz4's fast mode
+   rather than LZ4HC */
+#define OUT_ZSTD_LEVEL 3
+#define OUT_LZ4_LEVEL 0
+/* bytes kept from each end of the file to name it after its first and
+   last line.  A MAXSTRING word of 6 byte characters fits */
+#define OUT_ENDS 1024
+
+/* output of one -j job */
+#define JOB_BYTES 1048576
+
 static const wchar_t def_low_charset[] = L"abcdefghijklmnopqrstuvwxyz";
 static const wchar_t def_upp_charset[] = L"ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 static const wchar_t def_num_charset[] = L"0123456789";
 static const wchar_t def_sym_charset[] = L"!@#$%^&*()-_+=~`[]{}|\\:;\"'<>,.?/ ";
 static const char version[] = "3.6";
 
-static size_t inc[128];
+/* odometer state of the word being generated.  Every -j worker runs its own */
+static __thread size_t inc[128];
+static __thread size_t run[128]; /* -d only. length of the run of equal chars ending at each position, counted from the slow changing end */
+static __thread size_t inc_at_last = 0; /* variable positions whose inc[] is the last index of their charset */
+static __thread size_t inc_at_end = 0;  /* variable positions whose inc[] matches max_string */
 static size_t numofelements = 0;
 static size_t inverted = 0;  /* 0 for normal output 1 for aaa,baa,caa,etc */
 
@@ -39,7 +131,170 @@ static unsigned long long bytecount = 0 ;  /* user specified break output into s
 
 static volatile sig_atomic_t ctrlbreak = 0; /* 0 user did NOT press Ctrl-C 1 they did */
 
-static FILE *fptr;        /* file pointer */
+/* where the words go.  Buffered here and handed to write(2) a few MiB at a
+   time instead of going through stdio a line at a time */
+struct outbuf {
+  int fd;          /* stdout or the START file, -1 if neither is open */
+  char *buf;       /* size + SWEEP_SLACK bytes */
+  size_t len;      /* bytes waiting in buf */
+  size_t size;
+  long flush_ms;   /* write out what is waiting at least this often, 0 only when full */
+  unsigned ticks;  /* out_commit calls since the clock was last read */
+  struct timespec last; /* when buf was last written out */
+  char *pages;     /* --vmsplice: OUT_SLOTS page aligned buffers, buf is one of them.  NULL otherwise */
+  size_t stride;   /* --vmsplice: distance between two buffers in pages */
+  unsigned slot;   /* --vmsplice: which buffer buf is */
+  unsigned long long pushed; /* bytes handed to fd so far */
+  unsigned long long done_at[OUT_SLOTS]; /* --vmsplice: pushed when each buffer was last handed over */
+  int map;         /* bool. --mmap, buf points into a window of the file */
+  char *win;       /* --mmap: the mapped window, NULL if none */
+  unsigned long long pos;      /* --mmap and --uring: file offset of buf[0] */
+  unsigned long long reserved; /* --mmap: blocks are allocated up to here */
+  struct uring *ring; /* --uring, NULL if not used */
+  int direct;      /* bool. --direct, buf is aligned and only whole blocks leave it */
+  struct outz *z;  /* -z done in process, NULL if not */
+  char head[OUT_ENDS]; /* first and last bytes of the file, for out_end */
+  char tail[OUT_ENDS];
+  size_t headlen, taillen;
+  size_t seen;     /* bytes at the start of buf already in head and tail */
+  unsigned long long filebytes; /* bytes of words in the file */
+  unsigned long long filewords; /* --manifest: lines in the file */
+  unsigned long crc;            /* --manifest: CRC-32 of the file's words */
+};
+static struct outbuf out = { -1, NULL, 0, 0, 0, 0, { 0, 0 }, NULL, 0, 0, 0, { 0 }, 0, NULL, 0, 0, NULL, 0, NULL, { 0 }, { 0 }, 0, 0, 0, 0, 0, 0 };
+
+/* --zindex: where a block landed in the compressed file */
+struct zentry {
+  unsigned long long word;  /* number of its first word in the file, from 0 */
+  unsigned long long words; /* lines in it */
+  unsigned long long off;   /* compressed bytes in front of it */
+  unsigned long long size;  /* compressed bytes */
+  unsigned long long bytes; /* bytes of words */
+};
+
+/* -z: the stream going into the START file.  It spans every out_open and
+   out_close of that file and is only finished by renamefile, so the words
+   go to disk compressed and the file never exists uncompressed */
+struct outz {
+  int algo;        /* OUT_GZIP and so on */
+  int open;        /* bool. a stream has been started and not finished */
+  char *buf;       /* OUT_Z_BYTES of compressed output */
+  struct zpool *pool; /* --zjobs, NULL if one stream is compressed as it goes */
+  unsigned long long blocks; /* --zjobs: blocks handed to the pool since out_zstart */
+  int indexed;     /* bool. --zindex, keep a zentry per block */
+  struct zentry *index;
+  size_t nindex, maxindex;
+#ifdef HAVE_ZLIB
+  z_stream gz;
+#endif
+#ifdef HAVE_BZLIB
+  bz_stream bz;
+#endif
+#ifdef HAVE_LZMA
+  lzma_stream xz;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx *zs;
+#endif
+#ifdef HAVE_LZ4
+  LZ4F_cctx *lz;
+#endif
+};
+#define OUT_GZIP 1
+#define OUT_BZIP2 2
+#define OUT_LZMA 3
+#define OUT_ZSTD 4
+#define OUT_LZ4 5
+#define OUT_XZ 6
+static const char *const out_zext[] = { "", ".gz", ".bz2", ".lzma", ".zst", ".lz4", ".xz" };
+static const char *const out_zname[] = { "", "gzip", "bzip2", "lzma", "zstd", "lz4", "xz" };
+#define ZSTD_SKIP_MAGIC 0x184D2A5EU /* --zindex: seek table at the end of a .zst, */
+#define ZSTD_SEEK_MAGIC 0x8F92EAB1U /* in the zstd seekable format */
+
+/*
+  --zjobs: output buffers compressed by a pool of threads, each into a gzip
+  member, bzip2 or xz stream, or zstd or lz4 frame of its own.  Those are
+  allowed to follow each other in a file and the decompressors read them
+  as one.  .lzma files can't do that
+*/
+struct zblock {
+  char *in;        /* a full output buffer, swapped for out.buf */
+  size_t inlen;
+  char *out;       /* what it compressed to */
+  size_t outlen, outsize;
+  unsigned long long words; /* lines in in, for --zindex */
+  int state;       /* 0 free, 1 waiting, 2 being compressed, 3 ready to be written */
+};
+struct zpool {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct zblock *slots;       /* block t uses slots[t % nslots] */
+  size_t nslots;
+  unsigned long long next;    /* blocks handed to the pool */
+  unsigned long long taken;   /* blocks a thread has started on */
+  unsigned long long written; /* blocks written out, in order */
+  int algo;
+  int quit;                   /* bool. the threads should return */
+  pthread_t *threads;
+  size_t nthreads;
+};
+
+/* -z with 7z, or a crunch built without the library: programs compressing
+   finished files while the next one is made.  --zjobs of them, 1 by default */
+struct zprog {
+  pid_t pid;
+  char *file;      /* the file it was run on */
+  int is7z;        /* bool. 7z leaves file behind, it is removed afterwards */
+};
+static struct zprog *zprogs = NULL;
+static size_t nzprogs = 0;
+static size_t maxzprogs = 1;
+static const char *manifest = NULL; /* --manifest, a line per finished -o file */
+
+/* -r with -z: START read back through the decompressor */
+struct zin {
+  int algo;
+  int fd;
+  int end;         /* bool. nothing more can be decoded */
+  char *buf;       /* OUT_Z_BYTES of compressed input */
+  size_t len, pos;
+#ifdef HAVE_ZLIB
+  gzFile gz;
+#endif
+#ifdef HAVE_BZLIB
+  FILE *fp;
+  BZFILE *bz;
+#endif
+#ifdef HAVE_LZMA
+  lzma_stream xz;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_DCtx *zs;
+#endif
+#ifdef HAVE_LZ4
+  LZ4F_dctx *lz;
+#endif
+};
+
+#ifdef HAVE_URING
+/* --uring: the rings shared with the kernel and the buffers written
+   through them.  Buffer k is free once done[k] == len[k] */
+struct uring {
+  int fd;
+  void *sq_ring, *cq_ring;
+  size_t sq_len, cq_len, sqes_len;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  int fixed;       /* bool. the buffers are registered with the kernel */
+  unsigned cur;    /* buffer out.buf is */
+  char *bufs[OUT_URING_BUFS];
+  size_t len[OUT_URING_BUFS];  /* bytes handed to the kernel */
+  size_t done[OUT_URING_BUFS]; /* bytes it has written so far */
+  unsigned long long at[OUT_URING_BUFS]; /* file offset of each buffer */
+};
+#endif
 
 static int output_unicode = 0; /* bool. If nonzero, all output will be unicode. Can be set even if non-unicode input*/
 
@@ -66,6 +321,17 @@ struct thread_data{
   unsigned long long linecounter; /* counts number of lines in output resets to 0 */
 };
 
+/* character set already converted to output bytes */
+struct symtab {
+  wchar_t *cset;
+  size_t clen;
+  size_t rev[256];    /* index into cset of chars below 256, NPOS if not a member */
+  char *bytes;        /* entry i starts at bytes[i*width] */
+  unsigned char *len; /* number of bytes used by entry i */
+  size_t width;       /* bytes reserved for each entry, 1 unless output is unicode */
+  int uniform;        /* bool. every entry has the same number of bytes */
+};
+
 /* pattern info */
 struct pinfo {
   wchar_t *cset; /* character set pattern[i] is member of */
@@ -73,6 +339,39 @@ struct pinfo {
   int is_fixed; /* whether pattern[i] is a fixed value */
   size_t start_index, end_index; /* index into cset for the start and end strings */
   size_t duplicates;
+  int is_literal; /* bool. fixed @,%^ placeholder from -l */
+  const struct symtab *syms; /* output bytes for cset, NULL if is_fixed */
+  char fixed[MB_LEN_MAX]; /* output bytes for pattern[i] if is_fixed */
+  size_t fixedlen;
+};
+
+/* variable position of the word */
+struct pvar {
+  size_t pos; /* index into the word */
+  const wchar_t *cset;
+  size_t clen;
+  size_t end_index; /* index of max_string[pos] in cset */
+};
+
+/* pattern compiled by fill_pattern_info for increment, finished and friends */
+struct plan {
+  struct pvar *vars; /* variable positions in word order */
+  size_t nvars_len[MAXSTRING+1]; /* number of variable positions in a word of length len */
+  size_t vindex[MAXSTRING]; /* index into vars of position i, NPOS if pattern[i] is fixed */
+  int check_dupes; /* bool. -d was used */
+  size_t dupe_limit[256]; /* smallest -d limit among the charsets holding char c */
+};
+
+/* word counts for rank_word and unrank_word under -d.  ways(k, c, r) is the
+   number of ways to finish a word from the k-th position in order of
+   significance when the position before it holds chars[c] r times in a row */
+struct rankinfo {
+  size_t len;
+  wchar_t *chars; /* distinct chars a word of length len can hold */
+  size_t nchars;  /* chars[nchars] stands for "no position before" */
+  size_t *limit;  /* -d limit of chars[c], NPOS if it can't be reached in len chars */
+  size_t nruns;   /* largest limit, longer runs never get counted */
+  unsigned long long *ways;
 };
 
 /* program options */
@@ -97,10 +396,131 @@ struct opts_struct {
   wchar_t *max_string; /* either startstring/endstring or calculated using the pattern */
 
   struct pinfo *pattern_info; /* information generated from pattern */
+  struct symtab symtabs[4]; /* output bytes for low, upp, num and sym charsets */
+  struct plan *plan;
+  int uniform_width; /* bool. each position of the word always renders to the same number of bytes */
 };
 typedef struct opts_struct options_type;
 
+/* --manifest: to rank the first word of each file, NULL for permute */
+static const options_type *manifest_options = NULL;
+
+/* --checkpoint: START.ckpt is brought up to date every checkpoint_ms while
+   checkpoint_fpath is being written, NULL when it isn't */
+static long checkpoint_ms = 0;
+static const char *checkpoint_fpath = NULL;
+static const options_type *checkpoint_options = NULL;
+static struct timespec checkpoint_last;
+
+/* output a -j worker renders between looking for thieves */
+#define STEAL_BYTES 65536
+
+/* resumable word generator of a -j worker */
+struct gen {
+  wchar_t block2[MAXSTRING+1];
+  size_t lineoff[MAXSTRING+1];
+  char *line;     /* current word rendered, gconvlen + SWEEP_SLACK bytes */
+  size_t len, outlen;
+  int can_sweep;  /* bool. sweep_word may be used for this length */
+  int stale;      /* bool. line was already written out */
+};
+
+/* consecutive words of a job, rendered by one worker */
+struct piece {
+  char *buf;
+  size_t len;                   /* bytes used in buf */
+  unsigned long long first;     /* keyspace index of the first word */
+  unsigned long long next, end; /* words next..end-1 are not rendered yet */
+  int done;                     /* bool */
+  struct piece *after;          /* rest of the job, split off by thieves */
+};
+
+/* consecutive words of the keyspace written in one go */
+struct job {
+  struct piece head;
+  size_t pending; /* pieces not done yet */
+  int state;      /* 0 free, 1 being filled, 2 ready to be written */
+};
+
+/* shared by chunk_jobs() and its workers */
+struct jobqueue {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct job *slots;       /* job t uses slots[t % nslots] */
+  size_t nslots;
+  unsigned long long next;    /* next job to hand out */
+  unsigned long long written; /* jobs the writer is done with */
+  unsigned long long njobs;
+  unsigned long long first;   /* keyspace index of the first word of job 0 */
+  unsigned long long total;   /* words in all jobs */
+  unsigned long long per_job; /* words in each job but the last */
+  unsigned long long batch;   /* words rendered between looking for thieves */
+  size_t linemax;             /* longest line in bytes */
+  const options_type *options;
+};
+
+/* the words of one length, as chunk_split() plans the files */
+struct splitlen {
+  unsigned long long end; /* index just past its last word, counting from first */
+  size_t outlen;          /* bytes of each word, without the newline.  For -b */
+  int tail;               /* bool. its last word goes in even when a file is full */
+};
+
+/* a -c or -b file chunk_split() makes */
+struct splitfile {
+  unsigned long long first;  /* keyspace index of its first word */
+  unsigned long long words;
+  unsigned long long bytes;  /* of words, before -z */
+  unsigned long crc;         /* CRC-32 of the words */
+  char *name;                /* what it ended up as */
+  char *firstword, *lastword;
+  int state;                 /* 0 free, 1 being made, 2 done */
+};
+
+/* shared by chunk_split() and its workers */
+struct splitqueue {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct splitfile *slots;    /* file t uses slots[t % nslots] */
+  size_t nslots;
+  unsigned long long next;    /* next file to hand out */
+  unsigned long long written; /* files chunk_split is done with */
+  unsigned long long nfiles;
+  unsigned long long first;   /* keyspace index of the first word of file 0 */
+  unsigned long long total;   /* words in all files */
+  unsigned long long from;    /* first word of file next, counting from first */
+  struct splitlen *lens;      /* the lengths from first on */
+  size_t nlens;
+  unsigned long long batch;   /* words rendered into a buffer at a time */
+  size_t linemax;             /* longest line in bytes */
+  const char *fpath;          /* START, the files go next to it */
+  int algo;                   /* -z compressed in process, 0 if not */
+  const options_type *options;
+};
+
+/* shared by chunk_pwrite() and its workers */
+struct pwritequeue {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int *state;                 /* job t uses state[t % nslots]: 0 free, 1 being written, 2 done */
+  size_t nslots;
+  unsigned long long next;    /* next job to hand out */
+  unsigned long long written; /* jobs chunk_pwrite is done with */
+  unsigned long long njobs;
+  unsigned long long first;   /* keyspace index of the first word of job 0 */
+  unsigned long long total;   /* words in all jobs */
+  unsigned long long per_job; /* words in each job but the last */
+  unsigned long long batch;   /* words rendered into a buffer at a time */
+  unsigned long long skip;    /* bytes of the words before first */
+  unsigned long long base;    /* file offset of the first word */
+  size_t linemax;             /* longest line in bytes */
+  int fd;
+  const char *fpath;
+  const options_type *options;
+};
+
 static struct thread_data my_thread;
+static unsigned long crc_table[256]; /* --manifest, filled by crc_init */
 
 
 static int wcstring_cmp(const void *a, const void *b);
@@ -112,26 +532,138 @@ static size_t force_narrow_string(char *out, const wchar_t* src, size_t n);
 static size_t make_narrow_string(char *out, const wchar_t* src, size_t n);
 static int getmblen(wchar_t wc);
 static wchar_t *dupwcs(const wchar_t *s);
+static size_t encode_char(char *out, wchar_t wc);
+static void fill_symtab(struct symtab *st, wchar_t *cset, size_t clen);
 static int check_member(const wchar_t *string1, const options_type* options);
 static size_t find_index(const wchar_t *cset, size_t clen, wchar_t tofind);
 static void fill_minmax_strings(options_type *options);
 static void fill_pattern_info(options_type *options);
+static void fill_plan(options_type *options);
+static void free_pattern_info(options_type *options);
+static size_t symtab_index(const struct symtab *st, wchar_t c);
+static size_t render_word(char *out, size_t *off, size_t from, size_t len, const options_type *options);
+static size_t rerender_word(char *out, size_t *off, size_t pos, size_t len, const options_type *options);
+static void fill_sweep(char *out, const char *line, size_t linelen, size_t pos, const char *syms, size_t n);
+static size_t sweep_tile(char *buf, size_t room, wchar_t *block2, char *line, const size_t *off, size_t len, const options_type *options, unsigned long long maxlines);
+static int sweep_ok(size_t len, const options_type *options);
+static size_t sweep_word(char *buf, size_t room, wchar_t *block2, char *line, const size_t *off, size_t len, const options_type *options, unsigned long long maxlines);
+static void out_init(size_t size, long flush_ms);
+static void out_writev(const char *a, size_t alen, const char *b, size_t blen);
+static void out_flush(void);
+static void out_ends(const char *s, size_t n);
+static void out_end(char *line, size_t size, int last);
+static void out_vmsplice(void);
+static void out_free(void);
+static void out_uring(void);
+static void out_direct(void);
+static void out_blocks(void);
+static void out_compress(const char *algo);
+static void out_zstart(void);
+static void out_zwrite(const char *s, size_t n, int finish);
+static void out_zfinish(const char *fpath);
+static size_t out_zread(struct zin *in, char *buf, size_t n);
+static void out_zresume(const char *fpath, char *line, size_t size);
+static int out_fixed(void);
+static void out_zpool(size_t threads);
+static void *zpool_worker(void *arg);
+static void out_zblock(int algo, struct zblock *b);
+static void out_zsubmit(void);
+static int zpool_write(struct zpool *p);
+static void out_zdrain(void);
+static void out_zindex(const char *fpath);
+static void zprog_reap(size_t keep);
+static void out_manifest(const char *fpath, const char *compressalgo);
+static void manifest_add(const char *name, unsigned long long bytes, unsigned long long words, unsigned long crc, unsigned long long rank, const char *first, const char *last);
+static void out_sum(const char *s, size_t n);
+static void crc_init(void);
+static unsigned long crc_update(unsigned long crc, const char *s, size_t n);
+static char *split_name(const char *fpath, const char *first, const char *last, const char *ext);
+static const char *zprog_ext(const char *compressalgo);
+static void zprog_start(const char *file, const char *compressalgo);
+static void split_write(int fd, const char *s, size_t n, const char *fpath);
+static void split_file(struct splitqueue *q, struct splitfile *f, struct gen *g, char *buf, struct zblock *b);
+static int split_tail(size_t len, const options_type *options);
+static unsigned long long split_end(const struct splitqueue *q, unsigned long long from);
+static void *split_worker(void *threadarg);
+static void chunk_split(const size_t start, const size_t end, const wchar_t *startblock, const options_type options, const char *fpath, const char *compressalgo, size_t jobs);
+static size_t line_bytes(size_t len, const options_type *options);
+static unsigned long long keyspace_bytes(unsigned long long index, const options_type *options);
+static void pwrite_all(int fd, const char *s, size_t n, unsigned long long at, const char *fpath);
+static void *pwrite_worker(void *threadarg);
+static void chunk_pwrite(const size_t start, const size_t end, const wchar_t *startblock, const options_type options, const char *fpath, const char *outputfilename, size_t jobs);
+static void out_zseektable(void);
+static void uring_submit(unsigned k);
+static void uring_reap(int wait);
+static void uring_flush(void);
+#ifdef HAVE_URING
+static int uring_can_write(int fd);
+static void uring_drop(struct uring *r);
+#endif
+static char *out_reserve(size_t n);
+static void out_commit(size_t n);
+static void out_write(const char *s, size_t n);
+static void out_mmap(void);
+static void out_map_at(unsigned long long off);
+static unsigned long long out_unmap(void);
+static int out_open(const char *fpath, int append, unsigned long long expect);
+static int out_close(void);
+static unsigned long long file_bytes(size_t end);
+static size_t sweep_room(size_t maxclen, size_t outlen);
+static size_t out_sweep(wchar_t *block2, char *line, const size_t *off, size_t len, const options_type *options, size_t maxclen, unsigned long long maxlines);
 static unsigned long long fill_next_count(size_t si, size_t ei, int repeats, unsigned long long sum, /*@null@*/ unsigned long long *current_count, /*@out@*/ unsigned long long *next_count, size_t len);
 static unsigned long long calculate_with_dupes(int start_point, int end_point, size_t first, size_t last, size_t pattern_index, int repeats, unsigned long long current_sum, /*@null@*/ unsigned long long *current_count, const options_type options, size_t plen);
 static unsigned long long calculate_simple(const wchar_t *startstring, const wchar_t *endstring, const wchar_t *cset, size_t clen);
 static void count_strings(unsigned long long *lines, unsigned long long *bytes, const options_type options);
-static int finished(const wchar_t *block, const options_type options);
-static int too_many_duplicates(const wchar_t *block, const options_type options);
-static void increment(wchar_t *block, const options_type options);
+static unsigned long long add_sat(unsigned long long a, unsigned long long b);
+static unsigned long long mul_sat(unsigned long long a, unsigned long long b);
+static size_t rank_char(const struct rankinfo *ri, wchar_t c);
+static unsigned long long *rank_ways(const struct rankinfo *ri, size_t k, size_t c, size_t r);
+static unsigned long long rank_step(const struct rankinfo *ri, size_t k, size_t c, size_t r, size_t x);
+static void fill_rankinfo(struct rankinfo *ri, size_t len, const options_type *options);
+static void free_rankinfo(struct rankinfo *ri);
+static unsigned long long count_words(size_t len, const options_type *options);
+static unsigned long long rank_word(const wchar_t *block, size_t len, const options_type *options);
+static void unrank_word(wchar_t *block, size_t len, unsigned long long index, const options_type *options);
+static unsigned long long rank_keyspace(const wchar_t *word, size_t len, const options_type *options);
+static unsigned long long count_keyspace(const options_type *options);
+static size_t unrank_keyspace(wchar_t *word, unsigned long long index, const options_type *options);
+static void count_inc(const wchar_t *block, size_t len, const options_type *options);
+static void move_inc(const struct pvar *v, size_t from, size_t to);
+static int finished(size_t len, const options_type *options);
+static int reached_endstring(size_t len, const options_type *options);
+static size_t char_dupe_limit(wchar_t c, const options_type *options);
+static int too_many_duplicates(const wchar_t *block, size_t len, const options_type *options);
+static size_t count_run(const wchar_t *block, size_t pos, size_t len);
+static int hopeless_run(size_t pos, const options_type *options);
+static int fill_valid(wchar_t *block, size_t pos, size_t len, const options_type *options);
+static size_t next_valid(wchar_t *block, size_t len, size_t k, const options_type *options);
+static void make_valid(wchar_t *block, size_t len, const options_type *options);
+static size_t increment(wchar_t *block, size_t len, const options_type *options);
 static void *PrintPercentage(void *threadarg);
 static void renamefile(const size_t end, const char *fpath, const char *outputfilename, const char *compressalgo);
-static void printpermutepattern(const wchar_t *block2, const wchar_t *pattern, const wchar_t *literalstring, wchar_t **wordarray);
+static void printpermutepattern(wchar_t **wordarray, const options_type *options);
 static void Permute(const char *fpath, const char *outputfilename, const char *compressalgo, wchar_t **wordarray, const options_type options, const size_t sizePerm, size_t unchanged);
 static void Permutefilesize(wchar_t **wordarray, const size_t sizePerm, const size_t length, size_t unchanged);
-static void loadstring(wchar_t *block2, const size_t j, const wchar_t *startblock, const options_type options);
+static void loadstring(wchar_t *block2, const size_t j, const wchar_t *startblock, const options_type *options);
 static void chunk(const size_t start, const size_t end, const wchar_t *startblock, const options_type options, const char *fpath, const char *outputfilename, const char *compressalgo);
+static void gen_render(struct gen *g, const options_type *options);
+static void gen_seek(struct gen *g, unsigned long long index, const options_type *options);
+static void gen_advance(struct gen *g, const options_type *options);
+static size_t gen_fill(struct gen *g, char *buf, unsigned long long count, const options_type *options);
+static struct piece *take_piece(struct jobqueue *q);
+static void *job_worker(void *threadarg);
+static unsigned long long job_first(size_t start, const wchar_t *startblock, const options_type *options, unsigned long long *total);
+static size_t job_linemax(size_t end);
+static unsigned long long job_words(unsigned long long bytes, size_t linemax);
+static void chunk_jobs(const size_t start, const size_t end, const wchar_t *startblock, const options_type options, const char *fpath, const char *outputfilename, const char *compressalgo, size_t jobs);
 static void usage();
-static wchar_t *resumesession(const char *fpath, const wchar_t *charset);
+static char *checkpoint_name(const char *fpath);
+static size_t out_torn(void);
+static void out_checkpoint(void);
+static void checkpoint_write(const char *fpath, const options_type *options);
+static int resume_ends(int fd, unsigned long long end, char *first, size_t fsize, char *line, size_t lsize);
+static wchar_t *resume_fast(const char *fpath, const options_type *options, char *line, size_t size);
+static wchar_t *resumesession(const char *fpath, const options_type *options);
 static wchar_t *readcharsetfile(const char *charfilename, const char *charsetname, int* r_is_unicode);
 static wchar_t **readpermute(const char *charfilename, int* r_is_unicode);
 static void copy_without_dupes(wchar_t* dest, wchar_t* src);